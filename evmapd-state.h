@@ -0,0 +1,129 @@
+/*
+ * evmapd - An input event remapping daemon for Linux
+ *
+ * Copyright (c) 2007 Theodoros V. Kalamatianos <nyb@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ *
+ * Shared memory state export (--state <file>)
+ *
+ * evmapd publishes the current state of its output device in a file that
+ * other processes may map. The file is updated once per output frame under
+ * a sequence lock: the writer makes the sequence number odd, updates the
+ * state and then makes it even again. Readers copy the state and retry if
+ * the sequence number was odd or changed meanwhile, so they never block the
+ * event loop.
+ *
+ * Usage:
+ *
+ *	struct evmapd_state *s = evmapd_state_open("/run/evmapd.state");
+ *	struct evmapd_state c;
+ *
+ *	if ((s != NULL) && (evmapd_state_read(s, &c) == 0))
+ *		... use c.abs[ABS_X], EVMAPD_STATE_KEY(&c, BTN_TRIGGER) ...
+ *	evmapd_state_close(s);
+ */
+
+#ifndef EVMAPD_STATE_H
+#define EVMAPD_STATE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+
+#define EVMAPD_STATE_MAGIC	0x534d5645		/* "EVMS" */
+#define EVMAPD_STATE_VERSION	1
+
+#define EVMAPD_STATE_KEYS	768			/* KEY_MAX + 1 */
+#define EVMAPD_STATE_ABS	64			/* ABS_MAX + 1 */
+
+#define EVMAPD_STATE_TRIES	100000
+
+struct evmapd_state {
+	uint32_t magic, version;
+	uint32_t seq;					/* Odd while being updated */
+	uint32_t pad;
+	uint64_t frame;					/* Output frames published */
+
+	uint64_t key[EVMAPD_STATE_KEYS / 64];		/* Output key bitmap */
+	int32_t abs[EVMAPD_STATE_ABS];			/* Output ABS values */
+	int32_t absmin[EVMAPD_STATE_ABS];		/* Output ABS ranges */
+	int32_t absmax[EVMAPD_STATE_ABS];
+	int32_t calmin[EVMAPD_STATE_ABS];		/* Calibrated input ABS ranges */
+	int32_t calmax[EVMAPD_STATE_ABS];
+};
+
+#define EVMAPD_STATE_KEY(s, k)	(((s)->key[(k) / 64] >> ((k) % 64)) & 1)
+
+
+
+/* Map a state file, returns NULL on error */
+static inline struct evmapd_state *evmapd_state_open(const char *path)
+{
+	struct evmapd_state *s;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if ((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(*s))) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED)
+		return NULL;
+
+	if ((s->magic != EVMAPD_STATE_MAGIC) || (s->version != EVMAPD_STATE_VERSION)) {
+		munmap(s, sizeof(*s));
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return s;
+}
+
+/* Take a consistent copy of the state, returns -1 if none could be had */
+static inline int evmapd_state_read(const struct evmapd_state *s, struct evmapd_state *c)
+{
+	uint32_t a, b;
+	int i;
+
+	for (i = 0; i < EVMAPD_STATE_TRIES; ++i) {
+		a = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (a & 1)
+			continue;
+
+		memcpy(c, s, sizeof(*c));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		b = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+		if (a == b)
+			return 0;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+static inline void evmapd_state_close(struct evmapd_state *s)
+{
+	if (s != NULL)
+		munmap(s, sizeof(*s));
+}
+
+#endif /* EVMAPD_STATE_H */
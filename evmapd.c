@@ -10,7 +10,7 @@
  *
  * Compilation:
  *
- * gcc -Wall -lcfg+ evmapd.c -o evmapd
+ * gcc -Wall -lcfg+ -lm -ldl evmapd.c -o evmapd
  */
 
 
@@ -26,21 +26,37 @@
 #define CFG_MV CFG_MULTI
 #define CFG_MS CFG_MULTI_SEPARATED
 
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
+#include <math.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "evmapd-state.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PT_AVX2			1
+#endif
+
 
 
 #define msg(m, ...)		info("%s: " m, argv0, ##__VA_ARGS__)
@@ -56,15 +72,16 @@
 
 
 
-static int detach = 0, grab = 0, log = 0, quiet = 0, verbose = 0;
+static int detach = 0, grab = 0, keymap = 0, syslg = 0, quiet = 0, verbose = 0;
 
 
 
-static char *argv0, *idev = NULL, *pidfile = NULL;
+static char *argv0, *idev = NULL, *odev = UINPUT_DEVICE, *pidfile = NULL;
 
 static int ifp = -1, ofp = -1;
 static int *kkm = NULL, *krm = NULL, *kam = NULL, *rkm = NULL, *rrm = NULL;
 static int *ram = NULL, *akm = NULL, *arm = NULL, *aam = NULL, **nm = NULL;
+static int *llm = NULL, *ssm = NULL;
 
 #define ARR(a, c, x, y)		((a)[((x) * (c)) + (y)])
 
@@ -80,21 +97,1871 @@ static int *ram = NULL, *akm = NULL, *arm = NULL, *aam = NULL, **nm = NULL;
 #define ARM(x, y)		ARR(arm, 2, (x), (y))
 #define AAM(x, y)		ARR(aam, 2, (x), (y))
 
+#define LLM(x, y)		ARR(llm, 2, (x), (y))
+#define SSM(x, y)		ARR(ssm, 2, (x), (y))
+
+#define EV_EV			0
+
+#define LEN(t, b)		(((b - 1) / (sizeof(t) * 8)) + 1)
+#define POS(c, b)		(b / (sizeof((c)[0]) * 8))
+#define OFF(c, b)		(b % (sizeof((c)[0]) * 8))
+#define GET(c, b)		((c[POS(c, b)] >> OFF(c, b)) & 1)
+#define SET(c, b, v)		(c)[POS(c, b)] = (((c)[POS(c, b)] & ~(1UL << OFF(c, b))) | \
+					((unsigned long)((v) > 0) << OFF(c, b)))
+
+/* Output key state */
+static unsigned long kst[LEN(long, KEY_MAX)];
+
+/* Events sent since the last SYN_REPORT */
+static int opend = 0;
+
+/* Shared memory state export, mapped file and its shadow copy */
+static char *stfile = NULL;
+static struct evmapd_state *st = NULL, sts;
+
+/* Per-axis normalisation state, one cache line per ABS axis */
+enum { NRM_NONE, NRM_RANGE, NRM_QUANT };
+
+struct abscal {
+	int norm;					/* Normalisation mode */
+	int ign, rdy, rmin, rmax, acnt, amin, amax, last;	/* Calibration state */
+	int nrng, nrst, nspk, nspkmin;			/* Parameters */
+	int imin, irng;					/* Input device range */
+	int crng;					/* Cached scale, 0 if unusable */
+} __attribute__((aligned(64)));
+
+static struct abscal ac[ABS_MAX + 1];
+
+/* Streaming quantile calibration state */
+#define QBUCKETS		64
+#define QWARM			32
+#define QWIN			8192
+#define QSMOOTH			16
+
+struct absqnt {
+	int h[QBUCKETS];				/* Sample histogram */
+	int tot, win;					/* Sample count, decay window */
+	int plo, phi;					/* Tracked percentiles (per mille) */
+	int ql, bl;					/* Low quantile bucket, samples below it */
+	int qh, ah;					/* High quantile bucket, samples above it */
+	int slo, shi;					/* Smoothed range (8-bit fixed point) */
+};
+
+static struct absqnt aq[ABS_MAX + 1];
+
+/* Multitouch slot state */
+#define MT_SLOTS		16
+
+#define ISMT(c)			(((c) >= ABS_MT_SLOT) && ((c) <= ABS_MT_TOOL_Y))
+#define ISMTLEG(c)		(((c) == ABS_X) || ((c) == ABS_Y) || ((c) == ABS_PRESSURE))
+#define ISMTTOOL(c)		(((c) == BTN_TOUCH) || ((c) == BTN_TOOL_FINGER) || ((c) == BTN_TOOL_DOUBLETAP) || \
+					((c) == BTN_TOOL_TRIPLETAP) || ((c) == BTN_TOOL_QUADTAP) || \
+					((c) == BTN_TOOL_QUINTTAP))
+
+struct mtslot {
+	int id;						/* Tracking ID, -1 if unused */
+	int x, y;					/* Position, after transformation */
+	int px, py;					/* Position at the last frame */
+	int fresh;					/* No previous position yet */
+};
+
+static struct mtslot mt[MT_SLOTS];
+static int mton = 0, mtcnv = 0, mtcur = 0, mtprim = -1, mttouch = 0;
+static int mtxf[3] = { 0, 0, 0 };			/* Swap, invert X, invert Y */
+static int mtabs[2] = { -1, -1 };			/* Single-touch ABS output */
+static int mtrel[3] = { -1, -1, 1 };			/* Pointer REL output, divisor */
+static int mtscr[3] = { -1, -1, 1 };			/* Scroll REL output, divisor */
+static int mtracc[2], mtsacc[2];			/* Sub-unit remainders */
+static int mtmin[2], mtrng[2];				/* Input X/Y ranges */
+static int lgmin[2], lgrng[2];				/* Single-touch X/Y ranges */
+
+/* Axis pairs, transformed together at SYN_REPORT */
+#define PAIRS			8
+#define Q			14
+#define QONE			(1 << Q)
+#define QSQRT			256
+
+struct axpair {
+	int x, y;					/* Output ABS codes */
+	int dz;						/* Radial deadzone */
+	int cs, sn;					/* Rotation */
+	int circ;					/* Square to circle mapping */
+	int cx, cy, rx, ry;				/* Centre, half range */
+	int vx, vy, dirty;				/* Buffered frame values */
+};
+
+static struct axpair ap[PAIRS];
+static int npair = 0;
+static signed char apx[ABS_MAX + 1];			/* Pair of each output axis */
+static int sqtab[QSQRT + 1];				/* sqrt(1 - t^2 / 2) */
+
+/* Response curves for REL output */
+#define RCURVE			128
+#define ACURVE			1024
+
+enum { CRV_LINEAR, CRV_POWER, CRV_PIECEWISE, CRV_SCURVE };
+
+static int *rcv[REL_MAX + 1], *acv[ABS_MAX + 1];	/* Curve tables */
+static int racc[REL_MAX + 1];				/* Sub-unit remainders */
+
+/* Motion sensor fusion */
+#define GBIAS			8				/* Gyro bias fixed point bits */
+#define GATAN			256
+#define GGAP			50000				/* Longest integration step (us) */
+
+enum { GY_OFF, GY_REL, GY_ABS };
+
+#define ISGY(c)			(((c) == gy.in[0]) || ((c) == gy.in[1]) || \
+					((c) == gy.acc[0]) || ((c) == gy.acc[1]))
+
+struct gyro {
+	int mode;
+	int in[2], out[2];				/* Yaw/pitch gyro axes, output axes */
+	int sens;					/* REL units per degree or ABS range (degrees) */
+	int acc[2], aw;					/* Up/forward accelerometer axes, weight */
+	int res;					/* Gyro units per degree/s */
+	int thr, still;					/* Stillness threshold (units), time (us) */
+	int omin[2], orng[2];				/* Output ranges */
+	int v[2], ref[2], a[2];				/* Gyro, stillness reference, accelerometer */
+	long long bias[2];				/* Gyro bias (GBIAS fixed point) */
+	long long ang[2];				/* REL remainders or ABS angles */
+	long long t, st;				/* Last frame, start of stillness (us) */
+	unsigned int ts, pts;				/* MSC_TIMESTAMP of this and the last frame */
+	int hts, cal, out0[2];
+};
+
+static struct gyro gy;
+static int atab[GATAN + 1];				/* atan(i / GATAN) in millidegrees */
+
+/* Timer wheel, driven by a timerfd in the event loop */
+#define WHEEL			256
+#define TICK			1000000LL			/* Wheel slot length (ns) */
+#define NSEC			1000000000LL
+
+struct tmr {
+	long long due;					/* Expiry time (CLOCK_MONOTONIC, ns) */
+	int (*fn)(struct tmr *);			/* Expiry handler */
+	int arg;					/* Handler argument */
+	struct tmr *next, **prev;			/* Slot list, prev is NULL when idle */
+	struct tmr *xnext;				/* Expired list */
+};
+
+static struct tmr *wheel[WHEEL];
+static int tfd = -1, ntmr = 0;
+static long long tarm = 0, wtick = 0;
+static int iclk = 0;					/* Input timestamps in CLOCK_MONOTONIC */
+
+/* Timing statistics */
+static long long tjn = 0, tjsum = 0, tjmax = 0;
+static volatile sig_atomic_t dump = 0;
+
+/* Timed key actions */
+#define ACTIONS			32
+#define MACRO_MAX		16
+
+enum { ACT_CHORD, ACT_TAPHOLD, ACT_MACRO, ACT_AUTOFIRE };
+enum { AS_IDLE, AS_PEND, AS_ON, AS_PASS };
+
+struct action {
+	int type, state;
+	int key[2];					/* Trigger keys */
+	int out[MACRO_MAX], nout;			/* Output keys */
+	long long per, t0;				/* Window or period (ns), start time */
+	int held, pend, step;
+	struct tmr t;
+};
+
+static struct action act[ACTIONS];
+static int nact = 0;
+static signed char actk[KEY_MAX + 1];			/* Action of each trigger key */
+
+/* Eager debouncing, indexed by key code */
+static int dbw[KEY_MAX + 1];				/* Window (ns), 0 if disabled */
+static long long dbt[KEY_MAX + 1];			/* Time of the last edge let through */
+static unsigned int dbn[KEY_MAX + 1];			/* Filtered bounces */
+static unsigned long dbst[LEN(long, KEY_MAX)];		/* State let through */
+static unsigned long dbraw[LEN(long, KEY_MAX)];		/* Actual input state */
+static struct tmr dbtmr[KEY_MAX + 1];
+
+/* Predictive upsampling of output ABS axes */
+#define UPGAP			(50 * (NSEC / 1000))		/* Longer input gaps start a new motion */
+
+struct upsmp {
+	long long per;					/* Output period (ns), 0 if disabled */
+	int ovs;					/* Overshoot limit, percent of a step */
+	int min, max;					/* Output range */
+	long long t0, t1;				/* Times of the last two real samples */
+	int v0, v1;					/* Their values */
+	int out;					/* Last value sent */
+	struct tmr t;
+};
+
+static struct upsmp up[ABS_MAX + 1];
+static int upgen = 0;
+static unsigned long long upn = 0;			/* Predicted samples sent */
+
+/* Force feedback forwarding, virtual to source device effect ids */
+static int iwr = 0, ffon = 0;
+static int ffmap[FF_MAX_EFFECTS];
+static long long ffn = 0, ffsum = 0, ffmax = 0;		/* Play latency statistics */
+
+/* Output frame rate limiting */
+static long long rper = 0, rlast = 0;			/* Frame period, last frame sent (ns) */
+static int rabs[ABS_MAX + 1], rrel[REL_MAX + 1], rmsc[MSC_MAX + 1];	/* Merged values */
+static unsigned long rdabs[LEN(long, ABS_MAX + 1)], rdrel[LEN(long, REL_MAX + 1)];
+static unsigned long rdmsc[LEN(long, MSC_MAX + 1)];
+static int rpend = 0, rkey = 0, rflush = 0;
+static unsigned long long rin = 0, rout = 0;		/* Frames received, sent */
+static struct tmr rtmr;
+
+/* Passthrough fast path, one bit per (type, code) that needs processing */
+#define IBATCH			64
+#define PTYPES			32
+#define PCODES			1024
+#define PTOUCH(t, c)		(((t) >= PTYPES) || ((c) >= PCODES) || \
+					((pbits[((t) * PCODES + (c)) / 32] >> ((c) % 32)) & 1))
+
+static unsigned int pbits[PTYPES * PCODES / 32];
+static unsigned long long (*ptcls)(struct input_event *, int);
+static unsigned long long ptn = 0, ptev = 0;		/* Events passed through, read */
+
+/* Events injected into the input stream by the timers */
+#define INJQ			16
+
+static struct input_event injq[INJQ];
+static int injr = 0, injw = 0;
+
+/* --key-key maps moved into the keymap of the input device */
+static struct input_keymap_entry *kmo = NULL;		/* Original entries */
+static int nkmo = 0;
+
+/* Remap kernel specialised for a rule set (--compile/--kernel) */
+static void *kdl = NULL;
+static int (*kern)(struct input_event *) = NULL;
+
+
+
+int info(const char *fmt, ...)
+{
+	va_list args;
+	int ret = 0;
+
+	va_start(args, fmt);
+	if (fileno(stderr) >= 0)
+		ret = vfprintf(stderr, fmt, args);
+	if (syslg > 1)
+		vsyslog(LOG_NOTICE, fmt, args);
+	va_end(args);
+
+	return ret;
+}
+
+/* Publish the output state of a complete frame */
+static void st_publish()
+{
+	unsigned int s;
+	int i;
+
+	for (i = 0; i < EVMAPD_STATE_ABS; ++i)
+		if (ac[i].norm && ac[i].rdy) {
+			sts.calmin[i] = ac[i].rmin;
+			sts.calmax[i] = ac[i].rmax;
+		} else {
+			sts.calmin[i] = ac[i].imin;
+			sts.calmax[i] = ac[i].imin + ac[i].irng;
+		}
+	++sts.frame;
+
+	s = st->seq;
+	__atomic_store_n(&(st->seq), s + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&(st->frame), &(sts.frame), sizeof(sts) - offsetof(struct evmapd_state, frame));
+	__atomic_store_n(&(st->seq), s + 2, __ATOMIC_RELEASE);
+}
+
+/* Track the output state for the state export */
+static void st_update(struct input_event *e)
+{
+	if ((e->type == EV_KEY) && (e->code < EVMAPD_STATE_KEYS)) {
+		if (e->value)
+			sts.key[e->code / 64] |= (1ULL << (e->code % 64));
+		else
+			sts.key[e->code / 64] &= ~(1ULL << (e->code % 64));
+	} else if ((e->type == EV_ABS) && (e->code < EVMAPD_STATE_ABS)) {
+		sts.abs[e->code] = e->value;
+	} else if ((e->type == EV_SYN) && (e->code == SYN_REPORT)) {
+		st_publish();
+	}
+}
+
+static void up_real(struct input_event *e);
+static int rate_snd(struct input_event *e);
+
+/* Send an event to the output device */
+static int snd(struct input_event *e)
+{
+	int ret;
+
+	opend = (e->type != EV_SYN) || (e->code != SYN_REPORT);
+
+	if ((rper > 0) && !rflush)
+		return rate_snd(e);
+
+#if DEBUG
+	if (verbose)
+		info("OUT: %6i %6i %6i\n", e->type, e->code, e->value);
+#endif
+
+	ret = write(ofp, e, sizeof(*e));
+	RETERR(ret < (int)(sizeof(*e)), ret >= 0, EIO, "Unable to send event to %s", odev);
+
+	if (e->type == EV_KEY)
+		SET(kst, e->code, e->value);
+	if ((e->type == EV_ABS) && (e->code <= ABS_MAX)) {
+		if (up[e->code].per && !upgen)
+			up_real(e);
+		up[e->code].out = e->value;
+	}
+	if (st != NULL)
+		st_update(e);
+
+	return 0;
+}
+
+#define EMIT(t, c, v)		do { \
+					ret = emit(t, c, v); \
+					if (ret != 0) \
+						return ret; \
+				} while (0)
+
+/* Send a newly generated event to the output device */
+static int emit(int type, int code, int value)
+{
+	struct input_event e;
+
+	memset(&e, 0, sizeof(e));
+	e.type = type;
+	e.code = code;
+	e.value = value;
+
+	return snd(&e);
+}
+
+/* Swap and/or invert a position, x is set for the X axis */
+static void mt_xform(struct input_event *e, int x, int *min, int *rng, int cx, int cy)
+{
+	if (mtxf[1 + !x])
+		e->value = 2 * min[!x] + rng[!x] - e->value;
+	if (mtxf[0]) {
+		e->code = x?cy:cx;
+		if (rng[!x] > 0)
+			e->value = min[x] + ((long)(e->value - min[!x]) * rng[x]) / rng[!x];
+	}
+}
+
+/* Multitouch ABS event handling, returns 1 if the event should be forwarded */
+static int mt_abs(struct input_event *e)
+{
+	struct mtslot *m = ((mtcur >= 0) && (mtcur < MT_SLOTS))?&mt[mtcur]:NULL;
+	int x = (e->code == ABS_MT_POSITION_X);
+
+	switch (e->code) {
+		case ABS_MT_SLOT:
+			mtcur = e->value;
+			break;
+		case ABS_MT_TRACKING_ID:
+			if (m != NULL) {
+				m->id = e->value;
+				m->fresh = 1;
+			}
+			break;
+		case ABS_MT_POSITION_X:
+		case ABS_MT_POSITION_Y:
+			/* Per-slot transformation */
+			mt_xform(e, x, mtmin, mtrng, ABS_MT_POSITION_X, ABS_MT_POSITION_Y);
+			if (mtxf[0])
+				x = !x;
+
+			if (m != NULL) {
+				if (x)
+					m->x = e->value;
+				else
+					m->y = e->value;
+			}
+			break;
+	}
+
+	return !mtcnv;
+}
+
+/* Split a motion into output units, keeping the remainder for later */
+static int mt_div(int *acc, int d, int div)
+{
+	int r;
+
+	*acc += d;
+	r = *acc / div;
+	*acc -= r * div;
+
+	return r;
+}
+
+/* Multitouch frame handling, called at SYN_REPORT */
+static int mt_syn()
+{
+	int i, n = 0, dx = 0, dy = 0, dn = 0, ret;
+	struct mtslot *p;
+
+	if (!mtcnv)
+		return 0;
+
+	/* Keep the primary touch for as long as it lasts */
+	if ((mtprim >= 0) && (mt[mtprim].id < 0))
+		mtprim = -1;
+	for (i = 0; i < MT_SLOTS; ++i)
+		if (mt[i].id >= 0) {
+			if (mtprim < 0)
+				mtprim = i;
+			if (!mt[i].fresh) {
+				dx += mt[i].x - mt[i].px;
+				dy += mt[i].y - mt[i].py;
+				++dn;
+			}
+			++n;
+		}
+	p = (mtprim >= 0)?&mt[mtprim]:NULL;
+
+	/* Single-touch ABS output */
+	if (mtabs[0] >= 0) {
+		if (p != NULL) {
+			EMIT(EV_ABS, mtabs[0], p->x);
+			EMIT(EV_ABS, mtabs[1], p->y);
+		}
+		if ((p != NULL) != mttouch) {
+			mttouch = (p != NULL);
+			EMIT(EV_KEY, BTN_TOUCH, mttouch);
+		}
+	}
+
+	/* Scrolling with two or more fingers, pointer motion otherwise */
+	if ((n > 1) && (mtscr[0] >= 0)) {
+		if (dn > 0) {
+			i = mt_div(&mtsacc[1], dy / dn, mtscr[2]);
+			if (i != 0)
+				EMIT(EV_REL, mtscr[0], -i);
+			i = mt_div(&mtsacc[0], dx / dn, mtscr[2]);
+			if (i != 0)
+				EMIT(EV_REL, mtscr[1], i);
+		}
+	} else if ((p != NULL) && (mtrel[0] >= 0) && !p->fresh) {
+		i = mt_div(&mtracc[0], p->x - p->px, mtrel[2]);
+		if (i != 0)
+			EMIT(EV_REL, mtrel[0], i);
+		i = mt_div(&mtracc[1], p->y - p->py, mtrel[2]);
+		if (i != 0)
+			EMIT(EV_REL, mtrel[1], i);
+	}
+
+	if (n < 2)
+		mtsacc[0] = mtsacc[1] = 0;
+	if (p == NULL)
+		mtracc[0] = mtracc[1] = 0;
+
+	for (i = 0; i < MT_SLOTS; ++i) {
+		mt[i].px = mt[i].x;
+		mt[i].py = mt[i].y;
+		mt[i].fresh = 0;
+	}
+
+	return 0;
+}
+
+/* Integer square root */
+static unsigned int isqrt(unsigned long long v)
+{
+	unsigned long long r = 0, b = 1ULL << 62;
+
+	while (b > v)
+		b >>= 2;
+	while (b != 0) {
+		if (v >= r + b) {
+			v -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+		b >>= 2;
+	}
+
+	return r;
+}
+
+#define QCLAMP(v)		(((v) > QONE)?QONE:(((v) < -QONE)?-QONE:(v)))
+
+/* Apply the 2D transformations to a pair of axis */
+static void pair_xform(struct axpair *a, int *px, int *py)
+{
+	long long x, y, t, r;
+
+	/* Move to the unit square */
+	x = (a->rx > 0)?(((long long)(*px - a->cx) << Q) / a->rx):0;
+	y = (a->ry > 0)?(((long long)(*py - a->cy) << Q) / a->ry):0;
+	x = QCLAMP(x);
+	y = QCLAMP(y);
+
+	/* Square to circle */
+	if (a->circ) {
+		t = x;
+		x = (x * sqtab[llabs(y) >> (Q - 8)]) >> Q;
+		y = (y * sqtab[llabs(t) >> (Q - 8)]) >> Q;
+	}
+
+	/* Rotation and skew correction */
+	if ((a->sn != 0) || (a->cs != QONE)) {
+		t = x;
+		x = (x * a->cs - y * a->sn) >> Q;
+		y = (t * a->sn + y * a->cs) >> Q;
+	}
+
+	/* Radial deadzone */
+	if (a->dz > 0) {
+		r = isqrt(x * x + y * y);
+		if (r <= a->dz) {
+			x = y = 0;
+		} else {
+			t = ((r - a->dz) << Q) / (QONE - a->dz);
+			x = (x * t) / r;
+			y = (y * t) / r;
+		}
+	}
+
+	x = QCLAMP(x);
+	y = QCLAMP(y);
+	*px = a->cx + ((x * a->rx) >> Q);
+	*py = a->cy + ((y * a->ry) >> Q);
+}
+
+/* Axis pair frame handling, called at SYN_REPORT */
+static int pair_syn()
+{
+	int i, x, y, ret;
+
+	for (i = 0; i < npair; ++i)
+		if (ap[i].dirty) {
+			x = ap[i].vx;
+			y = ap[i].vy;
+			pair_xform(&ap[i], &x, &y);
+			EMIT(EV_ABS, ap[i].x, x);
+			EMIT(EV_ABS, ap[i].y, y);
+			ap[i].dirty = 0;
+		}
+
+	return 0;
+}
+
+/* Fixed-point atan2 in millidegrees */
+static int iatan2(long long y, long long x)
+{
+	long long ay = llabs(y), ax = llabs(x), t;
+	int r, i;
+
+	if ((ax == 0) && (ay == 0))
+		return 0;
+
+	/* Table lookup on the smaller ratio, 8-bit interpolation */
+	t = (ay <= ax)?((ay << 16) / ax):((ax << 16) / ay);
+	i = t >> 8;
+	r = (i >= GATAN)?atab[GATAN]:(atab[i] + (((atab[i + 1] - atab[i]) * (int)(t & 255)) >> 8));
+	if (ay > ax)
+		r = 90000 - r;
+
+	if (x < 0)
+		r = 180000 - r;
+
+	return (y < 0)?-r:r;
+}
+
+/* Motion sensor ABS input, returns 1 if the event was consumed */
+static int gyro_abs(struct input_event *e)
+{
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		if (e->code == gy.in[i]) {
+			gy.v[i] = e->value;
+			return 1;
+		}
+		if (e->code == gy.acc[i]) {
+			gy.a[i] = e->value;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Motion sensor fusion, called at SYN_REPORT */
+static int gyro_syn(struct input_event *e)
+{
+	long long t = e->time.tv_sec * 1000000LL + e->time.tv_usec, dt, w, d, v, lim;
+	int i, ret, still = (gy.thr > 0);
+
+	/* Prefer the sensor timestamps, they do not suffer from delivery jitter */
+	if (gy.hts) {
+		dt = (unsigned int)(gy.ts - gy.pts);
+		gy.pts = gy.ts;
+	} else {
+		dt = t - gy.t;
+	}
+	gy.t = t;
+	if ((dt <= 0) || (dt > GGAP))
+		dt = 0;
+
+	/* Bias auto-calibration while the device rests */
+	for (i = 0; i < 2; ++i) {
+		if (llabs((long long)(gy.v[i] - gy.ref[i])) >= gy.thr)
+			still = 0;
+		if (gy.cal && (llabs(((long long)gy.v[i] << GBIAS) - gy.bias[i]) >= ((long long)gy.thr << GBIAS)))
+			still = 0;
+	}
+	if (!still) {
+		gy.ref[0] = gy.v[0];
+		gy.ref[1] = gy.v[1];
+		gy.st = t;
+	} else if (t - gy.st >= gy.still) {
+		for (i = 0; i < 2; ++i)
+			if (gy.cal)
+				gy.bias[i] += (((long long)gy.v[i] << GBIAS) - gy.bias[i]) >> 6;
+			else
+				gy.bias[i] = (long long)gy.v[i] << GBIAS;
+		gy.cal = 1;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		w = ((long long)gy.v[i] << GBIAS) - gy.bias[i];
+
+		if (gy.mode == GY_REL) {
+			/* Rotation in output units, the remainder is kept */
+			d = (long long)gy.res * 1000000LL << GBIAS;
+			gy.ang[i] += w * dt * gy.sens;
+			v = gy.ang[i] / d;
+			gy.ang[i] -= v * d;
+			if (v != 0)
+				EMIT(EV_REL, gy.out[i], v);
+			continue;
+		}
+
+		/* Rotation angle, saturated at the edge of the range */
+		lim = (long long)gy.sens * gy.res * 1000000LL << GBIAS;
+		gy.ang[i] += w * dt;
+		if ((i == 1) && (gy.aw != 0)) {
+			d = (long long)iatan2(gy.a[1], gy.a[0]) * gy.res * 1000LL << GBIAS;
+			if (gy.aw < 0)
+				d = -d;
+			gy.ang[i] += (d - gy.ang[i]) / 1000 * llabs(gy.aw);
+		}
+		if (gy.ang[i] > lim)
+			gy.ang[i] = lim;
+		if (gy.ang[i] < -lim)
+			gy.ang[i] = -lim;
+
+		v = gy.omin[i] + gy.orng[i] / 2 + (gy.ang[i] >> 16) * (gy.orng[i] / 2) / ((lim >> 16) + 1);
+		if (v != gy.out0[i]) {
+			EMIT(EV_ABS, gy.out[i], v);
+			gy.out0[i] = v;
+		}
+	}
+
+	return 0;
+}
+
+/* Response curve evaluation */
+static double curve_fn(int *p, double x)
+{
+	double a = p[1] / 100.0, b = p[2] / 100.0, c = p[3];
+
+	switch (p[0]) {
+		case CRV_POWER:
+			return a * c * pow(x / c, b);
+		case CRV_PIECEWISE:
+			return (x <= c)?(a * x):(a * c + b * (x - c));
+		case CRV_SCURVE:
+			return x * (a + (b - a) / (1.0 + exp(-8.0 * (x - c) / c)));
+	}
+
+	return a * x;
+}
+
+/* Bake a response curve into a table. REL tables hold the output for
+ * each input value (8-bit fixed point), ABS tables the output fraction
+ * for each 1/ACURVE of the deflection (16-bit fixed point). */
+static int *curve_tab(int *p, int abs)
+{
+	int i, n = abs?(ACURVE + 1):RCURVE, *t;
+
+	/* Default reference point */
+	if (p[3] <= 0) {
+		if (p[0] == CRV_POWER)
+			p[3] = abs?1000:1;
+		else
+			p[3] = abs?500:8;
+	}
+
+	t = malloc(n * sizeof(int));
+	if (t == NULL)
+		return NULL;
+
+	for (i = 0; i < n; ++i)
+		if (abs)
+			t[i] = lround(curve_fn(p, (1000.0 * i) / ACURVE) * 65.536);
+		else
+			t[i] = lround(curve_fn(p, i) * 256);
+
+	return t;
+}
+
+/* Apply a REL response curve, carrying the sub-unit remainder */
+static int curve_rel(int *t, int *acc, int v)
+{
+	int a = abs(v), q;
+
+	if (a < RCURVE)
+		q = t[a];
+	else
+		q = t[RCURVE - 1] + (a - RCURVE + 1) * (t[RCURVE - 1] - t[RCURVE - 2]);
+
+	*acc += (v < 0)?-q:q;
+	q = *acc / 256;
+	*acc -= q * 256;
+
+	return q;
+}
+
+/* Apply an ABS to REL response curve, carrying the sub-unit remainder */
+static int curve_abs(int *t, int *acc, int v, int min, int rng, int rmin, int rmax)
+{
+	int d = 2 * v - 2 * min - rng, q;
+
+	if (rng <= 0)
+		return 0;
+
+	q = ((long)abs(d) * ACURVE) / rng;
+	if (q > ACURVE)
+		q = ACURVE;
+	q = ((long)t[q] * ((d < 0)?-rmin:rmax)) >> 8;
+
+	*acc += (d < 0)?-q:q;
+	q = *acc / 256;
+	*acc -= q * 256;
+
+	return q;
+}
 
+/* Current CLOCK_MONOTONIC time in ns */
+static long long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/* Program the timerfd with an absolute expiry time, 0 disarms it */
+static int tmr_arm(long long due)
+{
+	struct itimerspec its;
+	int ret;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = due / NSEC;
+	its.it_value.tv_nsec = due % NSEC;
+
+	ret = timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	RETERN(ret < 0, "Unable to set timer");
+	tarm = due;
+
+	return 0;
+}
+
+static void tmr_del(struct tmr *t)
+{
+	if (t->prev == NULL)
+		return;
+
+	*(t->prev) = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+	t->next = NULL;
+	t->prev = NULL;
+	--ntmr;
+}
+
+static int tmr_add(struct tmr *t, long long due)
+{
+	/* Late timers go in the current slot, tmr_run() has scanned the past ones */
+	struct tmr **s = &wheel[(((due / TICK) < wtick)?wtick:(due / TICK)) % WHEEL];
+
+	tmr_del(t);
+
+	t->due = due;
+	t->next = *s;
+	if (*s != NULL)
+		(*s)->prev = &(t->next);
+	t->prev = s;
+	*s = t;
+	++ntmr;
+
+	if ((tarm == 0) || (due < tarm))
+		return tmr_arm(due);
+
+	return 0;
+}
+
+/* Find the earliest pending expiry time */
+static long long tmr_next()
+{
+	struct tmr *t;
+	long long r = 0;
+	int i;
+
+	if (ntmr == 0)
+		return 0;
+
+	for (i = 0; (i < WHEEL) && (r == 0); ++i)
+		for (t = wheel[(wtick + i) % WHEEL]; t != NULL; t = t->next)
+			if ((t->due / TICK <= wtick + i) && ((r == 0) || (t->due < r)))
+				r = t->due;
+
+	/* Nothing within one wheel revolution */
+	for (i = 0; (i < WHEEL) && (r == 0); ++i)
+		for (t = wheel[i]; t != NULL; t = t->next)
+			if ((r == 0) || (t->due < r))
+				r = t->due;
+
+	return r;
+}
+
+/* Run the expired timers */
+static int tmr_run()
+{
+	struct tmr *t, *n, *x = NULL;
+	unsigned long long exp;
+	long long now, tick, d;
+	int i, ret;
+
+	ret = read(tfd, &exp, sizeof(exp));
+	now = now_ns();
+	tick = now / TICK;
+
+	for (i = 0; (i < WHEEL) && (wtick + i <= tick); ++i)
+		for (t = wheel[(wtick + i) % WHEEL]; t != NULL; t = n) {
+			n = t->next;
+			if (t->due <= now) {
+				tmr_del(t);
+				t->xnext = x;
+				x = t;
+			}
+		}
+	wtick = tick;
+
+	for (t = x; t != NULL; t = t->xnext) {
+		/* Rescheduled by an earlier handler */
+		if (t->prev != NULL)
+			continue;
+
+		d = now - t->due;
+		++tjn;
+		tjsum += d;
+		if (d > tjmax)
+			tjmax = d;
+
+		ret = t->fn(t);
+		if (ret != 0)
+			return ret;
+	}
+
+	/* End the frame only if a handler sent anything */
+	if (opend)
+		EMIT(EV_SYN, SYN_REPORT, 0);
+
+	return tmr_arm(tmr_next());
+}
+
+/* Timed key action input handling */
+static int act_key(struct action *a, int code, int value)
+{
+	int k = (code == a->key[1]), ret;
+	long long now = now_ns();
+
+	/* Autorepeat only passes for keys that act as themselves */
+	if (value == 2) {
+		if ((a->type == ACT_CHORD) && (a->state == AS_PASS) && (a->held & (1 << k)))
+			EMIT(EV_KEY, code, 2);
+		return 0;
+	}
+
+	switch (a->type) {
+		case ACT_CHORD:
+			if (value)
+				a->held |= (1 << k);
+			else
+				a->held &= ~(1 << k);
+
+			switch (a->state) {
+				case AS_IDLE:
+					if (value) {
+						a->state = AS_PEND;
+						a->pend = k;
+						return tmr_add(&(a->t), now + a->per);
+					}
+					break;
+				case AS_PEND:
+					tmr_del(&(a->t));
+					if (value) {
+						a->state = AS_ON;
+						EMIT(EV_KEY, a->out[0], 1);
+					} else {
+						a->state = AS_IDLE;
+						EMIT(EV_KEY, code, 1);
+						EMIT(EV_SYN, SYN_REPORT, 0);
+						EMIT(EV_KEY, code, 0);
+					}
+					break;
+				case AS_ON:
+					if (!value && GET(kst, a->out[0]))
+						EMIT(EV_KEY, a->out[0], 0);
+					if (a->held == 0)
+						a->state = AS_IDLE;
+					break;
+				case AS_PASS:
+					EMIT(EV_KEY, code, value);
+					if (a->held == 0)
+						a->state = AS_IDLE;
+					break;
+			}
+			break;
+		case ACT_TAPHOLD:
+			if (value && (a->state == AS_IDLE)) {
+				a->state = AS_PEND;
+				return tmr_add(&(a->t), now + a->per);
+			} else if (!value && (a->state == AS_PEND)) {
+				tmr_del(&(a->t));
+				a->state = AS_IDLE;
+				EMIT(EV_KEY, a->out[0], 1);
+				EMIT(EV_SYN, SYN_REPORT, 0);
+				EMIT(EV_KEY, a->out[0], 0);
+			} else if (!value && (a->state == AS_ON)) {
+				a->state = AS_IDLE;
+				EMIT(EV_KEY, a->out[1], 0);
+			}
+			break;
+		case ACT_MACRO:
+			if (value && (a->state == AS_IDLE)) {
+				a->state = AS_ON;
+				a->t0 = now;
+				a->step = 1;
+				EMIT(EV_KEY, a->out[0], 1);
+				return tmr_add(&(a->t), a->t0 + a->per);
+			}
+			break;
+		case ACT_AUTOFIRE:
+			if (value && (a->state == AS_IDLE)) {
+				a->state = AS_ON;
+				a->t0 = now;
+				a->step = 1;
+				EMIT(EV_KEY, a->out[0], 1);
+				return tmr_add(&(a->t), a->t0 + a->per / 2);
+			} else if (!value && (a->state == AS_ON)) {
+				tmr_del(&(a->t));
+				a->state = AS_IDLE;
+				if GET(kst, a->out[0])
+					EMIT(EV_KEY, a->out[0], 0);
+			}
+			break;
+	}
+
+	return 0;
+}
+
+/* Timed key action timer handling */
+static int act_tmr(struct tmr *t)
+{
+	struct action *a = &act[t->arg];
+	int ret;
+
+	switch (a->type) {
+		case ACT_CHORD:
+			/* No chord, the first key acts as itself */
+			a->state = AS_PASS;
+			EMIT(EV_KEY, a->key[a->pend], 1);
+			break;
+		case ACT_TAPHOLD:
+			a->state = AS_ON;
+			EMIT(EV_KEY, a->out[1], 1);
+			break;
+		case ACT_MACRO:
+			EMIT(EV_KEY, a->out[a->step / 2], !(a->step & 1));
+			if (++(a->step) < 2 * a->nout)
+				return tmr_add(t, a->t0 + a->step * a->per);
+			a->state = AS_IDLE;
+			break;
+		case ACT_AUTOFIRE:
+			/* Schedule from the start time to avoid any drift */
+			EMIT(EV_KEY, a->out[0], !(a->step & 1));
+			++(a->step);
+			return tmr_add(t, a->t0 + (a->step * a->per) / 2);
+	}
+
+	return 0;
+}
+
+/* Allocate a timed key action */
+static struct action *act_new(int type, int k0, int k1)
+{
+	struct action *a;
+
+	if ((nact >= ACTIONS) || (k0 < 0) || (k0 > KEY_MAX) || (actk[k0] >= 0) ||
+			((k1 >= 0) && ((k1 > KEY_MAX) || (actk[k1] >= 0) || (k1 == k0))))
+		return NULL;
+
+	a = &act[nact];
+	memset(a, 0, sizeof(*a));
+	a->type = type;
+	a->key[0] = k0;
+	a->key[1] = k1;
+	a->t.fn = act_tmr;
+	a->t.arg = nact;
+
+	actk[k0] = nact;
+	if (k1 >= 0)
+		actk[k1] = nact;
+	++nact;
+
+	return a;
+}
+
+/* Queue an event for processing as if it came from the input device */
+static void inject(int type, int code, int value)
+{
+	if ((injw + 1) % INJQ == injr)
+		return;
+
+	memset(&injq[injw], 0, sizeof(injq[injw]));
+	injq[injw].type = type;
+	injq[injw].code = code;
+	injq[injw].value = value;
+	injw = (injw + 1) % INJQ;
+}
+
+/* Eager debouncing, returns 1 if the key event should be let through */
+static int debounce(struct input_event *e)
+{
+	long long t = iclk?(e->time.tv_sec * NSEC + e->time.tv_usec * 1000LL):now_ns();
+	int c = e->code;
+
+	if (e->value == 2)
+		return GET(dbst, c);
+
+	SET(dbraw, c, e->value);
+	if (e->value == GET(dbst, c))
+		return 0;
+
+	/* Opposite edge within the window, check again once it is over */
+	if (t - dbt[c] < dbw[c]) {
+		++dbn[c];
+		if (dbtmr[c].prev == NULL)
+			tmr_add(&dbtmr[c], now_ns() + dbw[c] - (t - dbt[c]));
+		return 0;
+	}
+
+	SET(dbst, c, e->value);
+	dbt[c] = t;
+
+	return 1;
+}
+
+/* End of a debounce window, catch up with a key that settled */
+static int debounce_tmr(struct tmr *t)
+{
+	int c = t->arg;
+
+	/* The settled edge opens a new window, so trailing chatter is filtered too */
+	if (GET(dbraw, c) != GET(dbst, c)) {
+		SET(dbst, c, GET(dbraw, c));
+		dbt[c] = now_ns();
+		inject(EV_KEY, c, GET(dbraw, c));
+		inject(EV_SYN, SYN_REPORT, 0);
+	}
+
+	return 0;
+}
+
+/* A real sample of an upsampled axis, the prediction restarts from it */
+static void up_real(struct input_event *e)
+{
+	struct upsmp *u = &up[e->code];
+	long long now = now_ns(), t = now;
+
+	if (iclk && (e->time.tv_sec || e->time.tv_usec))
+		t = e->time.tv_sec * NSEC + e->time.tv_usec * 1000LL;
+
+	u->t0 = u->t1;
+	u->v0 = u->v1;
+	u->t1 = t;
+	u->v1 = e->value;
+
+	tmr_add(&(u->t), now + u->per);
+}
+
+/* Extrapolate an upsampled axis between real samples */
+static int up_tmr(struct tmr *t)
+{
+	struct upsmp *u = &up[t->arg];
+	long long now = now_ns(), dt = u->t1 - u->t0, h = now - u->t1;
+	long long v = u->v1, d = u->v1 - u->v0, lim;
+	int ret;
+
+	if ((dt > 0) && (dt <= UPGAP) && (h < 2 * dt)) {
+		/* Predict at most one input period ahead, then wait for a report */
+		if (h < dt) {
+			v += d * h / dt;
+			tmr_add(t, now + u->per);
+		} else {
+			v += d;
+			tmr_add(t, u->t1 + 2 * dt);
+		}
+
+		lim = ((d < 0)?-d:d) * u->ovs / 100;
+		if (v > u->v1 + lim)
+			v = u->v1 + lim;
+		if (v < u->v1 - lim)
+			v = u->v1 - lim;
+		if (v > u->max)
+			v = u->max;
+		if (v < u->min)
+			v = u->min;
+	}
+
+	/* No report for two periods: the axis has stopped at its last real value */
+	if (v == u->out)
+		return 0;
+
+	upgen = 1;
+	ret = emit(EV_ABS, t->arg, v);
+	upgen = 0;
+	++upn;
+
+	return ret;
+}
+
+/* Upload an effect requested on the output device to the input device */
+static int ff_upload(int id)
+{
+	struct uinput_ff_upload u;
+	int ret, v;
+
+	memset(&u, 0, sizeof(u));
+	u.request_id = id;
+	ret = ioctl(ofp, UI_BEGIN_FF_UPLOAD, &u);
+	RETERN(ret < 0, "Unable to handle force feedback upload on %s", odev);
+
+	v = u.effect.id;
+	if ((v < 0) || (v >= FF_MAX_EFFECTS)) {
+		u.retval = -EINVAL;
+	} else {
+		u.effect.id = ffmap[v];
+		ret = ioctl(ifp, EVIOCSFF, &(u.effect));
+		u.retval = (ret < 0)?-errno:0;
+		if (ret >= 0)
+			ffmap[v] = u.effect.id;
+		u.effect.id = v;
+	}
+
+	ret = ioctl(ofp, UI_END_FF_UPLOAD, &u);
+	RETERN(ret < 0, "Unable to handle force feedback upload on %s", odev);
+
+	return 0;
+}
+
+static int ff_erase(int id)
+{
+	struct uinput_ff_erase e;
+	int ret, v;
+
+	memset(&e, 0, sizeof(e));
+	e.request_id = id;
+	ret = ioctl(ofp, UI_BEGIN_FF_ERASE, &e);
+	RETERN(ret < 0, "Unable to handle force feedback erase on %s", odev);
+
+	v = e.effect_id;
+	e.retval = 0;
+	if ((v >= 0) && (v < FF_MAX_EFFECTS) && (ffmap[v] >= 0)) {
+		ret = ioctl(ifp, EVIOCRMFF, ffmap[v]);
+		e.retval = (ret < 0)?-errno:0;
+		ffmap[v] = -1;
+	}
+
+	ret = ioctl(ofp, UI_END_FF_ERASE, &e);
+	RETERN(ret < 0, "Unable to handle force feedback erase on %s", odev);
+
+	return 0;
+}
+
+/* Map an LED or sound code written to the output device back to the input device */
+static int fb_code(int *m, int code)
+{
+	int i;
+
+	for (i = 0; (m != NULL) && (ARR(m, 2, i, 0) != -1); ++i)
+		if (ARR(m, 2, i, 1) == code)
+			return ARR(m, 2, i, 0);
+
+	return code;
+}
+
+/* Handle the feedback written to the output device: force feedback
+ * requests and effects, LEDs and sounds */
+static int fb_run()
+{
+	struct input_event e;
+	long long d;
+	int ret;
+
+	while (1) {
+		ret = read(ofp, &e, sizeof(e));
+		if ((ret < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+			return 0;
+		RETERR(ret < (int)(sizeof(e)), ret >= 0, EIO, "Unable to receive event from %s", odev);
+
+		if (e.type == EV_UINPUT) {
+			if (e.code == UI_FF_UPLOAD)
+				ret = ff_upload(e.value);
+			else if (e.code == UI_FF_ERASE)
+				ret = ff_erase(e.value);
+			if (ret != 0)
+				return ret;
+			continue;
+		}
+		if ((e.type == EV_LED) || (e.type == EV_SND)) {
+			e.code = fb_code((e.type == EV_LED)?llm:ssm, e.code);
+			ret = write(ifp, &e, sizeof(e));
+			if (ret < (int)(sizeof(e)))
+				msg("Warning: unable to send feedback event to %s\n", idev);
+			continue;
+		}
+		if (e.type != EV_FF)
+			continue;
+
+		/* Gain and autocenter are device-wide, the rest are effect ids */
+		if (e.code < FF_MAX_EFFECTS) {
+			if (ffmap[e.code] < 0)
+				continue;
+			e.code = ffmap[e.code];
+		}
+
+		ret = write(ifp, &e, sizeof(e));
+		if (ret < (int)(sizeof(e)))
+			msg("Warning: unable to send force feedback event to %s\n", idev);
+
+		/* uinput timestamps its requests with CLOCK_MONOTONIC */
+		d = now_ns() - (e.time.tv_sec * NSEC + e.time.tv_usec * 1000LL);
+		if ((d >= 0) && (d < NSEC)) {
+			++ffn;
+			ffsum += d;
+			if (d > ffmax)
+				ffmax = d;
+		}
+	}
+}
+
+/* Send the merged values and end the frame */
+static int rate_flush()
+{
+	int i, ret = 0;
+
+	rflush = 1;
+	for (i = 0; rpend && (ret == 0) && (i <= ABS_MAX); ++i)
+		if GET(rdabs, i) {
+			SET(rdabs, i, 0);
+			ret = emit(EV_ABS, i, rabs[i]);
+		}
+	for (i = 0; rpend && (ret == 0) && (i <= REL_MAX); ++i)
+		if GET(rdrel, i) {
+			SET(rdrel, i, 0);
+			if (rrel[i] != 0)
+				ret = emit(EV_REL, i, rrel[i]);
+			rrel[i] = 0;
+		}
+	for (i = 0; rpend && (ret == 0) && (i <= MSC_MAX); ++i)
+		if GET(rdmsc, i) {
+			SET(rdmsc, i, 0);
+			ret = emit(EV_MSC, i, rmsc[i]);
+		}
+	if (ret == 0)
+		ret = emit(EV_SYN, SYN_REPORT, 0);
+	rflush = 0;
+
+	rpend = rkey = 0;
+	rlast = now_ns();
+	++rout;
+	tmr_del(&rtmr);
+
+	return ret;
+}
+
+static int rate_tmr(struct tmr *t)
+{
+	return rpend?rate_flush():0;
+}
+
+/* Rate limited output: ABS, REL and MSC are merged until the next frame is
+ * due, anything else is sent at once. Key and switch edges end the frame
+ * early. */
+static int rate_snd(struct input_event *e)
+{
+	int ret;
+
+	switch (e->type) {
+		case EV_ABS:
+			/* The multitouch protocol does not survive merging */
+			if (ISMT(e->code) || (e->code > ABS_MAX))
+				break;
+			rabs[e->code] = e->value;
+			SET(rdabs, e->code, 1);
+			rpend = 1;
+			return 0;
+		case EV_REL:
+			if (e->code > REL_MAX)
+				break;
+			rrel[e->code] += e->value;
+			SET(rdrel, e->code, 1);
+			rpend = 1;
+			return 0;
+		case EV_MSC:
+			/* Sensor and touch timestamps come with every frame */
+			if (e->code > MSC_MAX)
+				break;
+			rmsc[e->code] = e->value;
+			SET(rdmsc, e->code, 1);
+			rpend = 1;
+			return 0;
+		case EV_SYN:
+			if (e->code != SYN_REPORT)
+				break;
+			if (!rpend && !rkey)
+				return 0;
+			++rin;
+			if (rkey || (now_ns() - rlast >= rper))
+				return rate_flush();
+			if (rtmr.prev == NULL)
+				return tmr_add(&rtmr, rlast + rper);
+			return 0;
+	}
+
+	rflush = 1;
+	ret = snd(e);
+	rflush = 0;
+	if (((e->type == EV_KEY) && (e->value != 2)) || (e->type == EV_SW))
+		rkey = 1;
+	else
+		rpend = 1;
+
+	return ret;
+}
+
+/* Whether an input code needs the generic event processing code */
+static int kspecial(int type, int code)
+{
+	int i;
+
+	switch (type) {
+		case EV_KEY:
+			return (dbw[code] > 0) || (actk[code] >= 0) || (mtcnv && ISMTTOOL(code));
+		case EV_REL:
+			for (i = 0; (rkm != NULL) && (RKM(i, 0) != -1); ++i)
+				if (RKM(i, 0) == code)
+					return 1;
+			return (rcv[code] != NULL);
+		case EV_ABS:
+			for (i = 0; (akm != NULL) && (AKM(i, 0) != -1); ++i)
+				if (AKM(i, 0) == code)
+					return 1;
+			return ac[code].norm || (mton && (ISMT(code) || ISMTLEG(code))) ||
+					(acv[code] != NULL) || (apx[code] >= 0) || (gy.mode && ISGY(code));
+	}
+
+	return 1;
+}
+
+/* Build the passthrough bitmap from the remapped codes and the stateful features */
+static void pt_build(unsigned long rb[EV_MAX][LEN(long, KEY_MAX)])
+{
+	int t, c, k;
+
+	memset(pbits, 0, sizeof(pbits));
+	for (t = 0; t < PTYPES; ++t)
+		for (c = 0; c < PCODES; ++c) {
+			switch (t) {
+				case EV_SYN:
+					k = (c == SYN_REPORT) && (mton || (npair > 0) || gy.mode);
+					break;
+				case EV_KEY:
+					/* Output key state is tracked for some maps */
+					k = (c > KEY_MAX) || GET(rb[t], c) || kspecial(t, c) ||
+							(rkm != NULL) || (akm != NULL) || (nact > 0);
+					break;
+				case EV_REL:
+					k = (c > REL_MAX) || GET(rb[t], c) || kspecial(t, c);
+					break;
+				case EV_ABS:
+					k = (c > ABS_MAX) || GET(rb[t], c) || kspecial(t, c) || (up[c].per > 0);
+					break;
+				case EV_MSC:
+					k = gy.mode && (c == MSC_TIMESTAMP);
+					break;
+				default:
+					k = (t >= EV_MAX) || (c >= KEY_MAX) || GET(rb[t], c);
+					break;
+			}
+
+			/* Verbose output, the state export and rate limiting need to see every event */
+			if (k || verbose || (st != NULL) || (rper > 0))
+				pbits[(t * PCODES + c) / 32] |= 1U << (c % 32);
+		}
+}
+
+/* Classify a batch of events, returns a mask of those that need processing */
+static unsigned long long pt_classify(struct input_event *e, int n)
+{
+	unsigned long long m = 0;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		if PTOUCH(e[i].type, e[i].code)
+			m |= 1ULL << i;
+
+	return m;
+}
+
+#if PT_AVX2
+/* Eight events at a time: gather the type and code words, then the bitmap words */
+__attribute__((target("avx2")))
+static unsigned long long pt_classify_avx2(struct input_event *e, int n)
+{
+	const int s = sizeof(*e) / 4;
+	const __m256i vi = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+	const __m256i mt = _mm256_set1_epi32(0xffff), mb = _mm256_set1_epi32(31);
+	const __m256i tmax = _mm256_set1_epi32(PTYPES - 1), cmax = _mm256_set1_epi32(PCODES - 1);
+	const __m256i one = _mm256_set1_epi32(1);
+	unsigned long long m = 0;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		const int *b = (const int *)&(e[i].type);
+		__m256i d, t, c, x, w, r;
+
+		d = _mm256_i32gather_epi32(b, vi, 4);
+		t = _mm256_and_si256(d, mt);
+		c = _mm256_srli_epi32(d, 16);
+
+		/* Out of range codes always need processing */
+		r = _mm256_or_si256(_mm256_cmpgt_epi32(t, tmax), _mm256_cmpgt_epi32(c, cmax));
+
+		x = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(t, tmax), 10), _mm256_and_si256(c, cmax));
+		w = _mm256_i32gather_epi32((const int *)pbits, _mm256_srli_epi32(x, 5), 4);
+		w = _mm256_and_si256(_mm256_srlv_epi32(w, _mm256_and_si256(x, mb)), one);
+		r = _mm256_or_si256(r, _mm256_cmpeq_epi32(w, one));
+
+		m |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(r)) << i;
+	}
+
+	/* A full batch leaves no tail, and a shift by 64 is undefined */
+	if (i < n)
+		m |= pt_classify(e + i, n - i) << i;
+
+	return m;
+}
+#endif
+
+/* Forward a run of events that need no processing */
+static int pt_snd(struct input_event *e, int n)
+{
+	int ret;
+
+	ret = write(ofp, e, n * sizeof(*e));
+	RETERR(ret < (int)(n * sizeof(*e)), ret >= 0, EIO, "Unable to send event to %s", odev);
+	ptn += n;
+
+	return 0;
+}
+
+/* Generate the C source of a remap kernel for the current rule set. The
+ * scales are folded into constants, and codes that need state are left
+ * to the generic code (return value 0). */
+static void kgen(FILE *f, struct uinput_user_dev *ui, struct uinput_user_dev *uo, int rmin, int rmax)
+{
+	int c, i, m, o;
+
+	fprintf(f, "int evmapd_kernel(struct input_event *ev)\n{\n\tswitch (ev->type) {\n");
+
+	/* KEY */
+	fprintf(f, "\tcase EV_KEY:\n\t\tswitch (ev->code) {\n");
+	for (c = 0; c <= KEY_MAX; ++c) {
+		if (kspecial(EV_KEY, c)) {
+			fprintf(f, "\t\tcase %d: return 0;\n", c);
+			continue;
+		}
+		for (i = 0; (kkm != NULL) && (KKM(i, 0) != -1); ++i)
+			if (KKM(i, 0) == c)
+				break;
+		if ((kkm != NULL) && (KKM(i, 0) != -1)) {
+			fprintf(f, "\t\tcase %d: ev->code = %d; return 1;\n", c, KKM(i, 1));
+			continue;
+		}
+		for (i = 0; (krm != NULL) && (KRM(i, 0) != -1); ++i)
+			if ((KRM(i, 0) == c) || (KRM(i, 1) == c))
+				break;
+		if ((krm != NULL) && (KRM(i, 0) != -1)) {
+			fprintf(f, "\t\tcase %d: ev->type = EV_REL; ev->code = %d; ev->value = (ev->value > 0)?%d:%d; return 1;\n",
+					c, KRM(i, 2), (c == KRM(i, 0))?rmin:rmax, rmin + (rmax - rmin) / 2);
+			continue;
+		}
+		for (i = 0; (kam != NULL) && (KAM(i, 0) != -1); ++i)
+			if ((KAM(i, 0) == c) || (KAM(i, 1) == c))
+				break;
+		if ((kam != NULL) && (KAM(i, 0) != -1)) {
+			o = KAM(i, 2);
+			if (apx[o] >= 0)
+				fprintf(f, "\t\tcase %d: return 0;\n", c);
+			else
+				fprintf(f, "\t\tcase %d: ev->type = EV_ABS; ev->code = %d; ev->value = (ev->value > 0)?%d:%d; return 1;\n",
+						c, o, (c == KAM(i, 0))?uo->absmin[o]:uo->absmax[o],
+						uo->absmin[o] + (uo->absmax[o] - uo->absmin[o]) / 2);
+		}
+	}
+	fprintf(f, "\t\t}\n\t\treturn 1;\n");
+
+	/* REL */
+	fprintf(f, "\tcase EV_REL:\n\t\tswitch (ev->code) {\n");
+	for (c = 0; c <= REL_MAX; ++c) {
+		if (kspecial(EV_REL, c)) {
+			fprintf(f, "\t\tcase %d: return 0;\n", c);
+			continue;
+		}
+		for (i = 0; (rrm != NULL) && (RRM(i, 0) != -1); ++i)
+			if (RRM(i, 0) == c)
+				break;
+		if ((rrm != NULL) && (RRM(i, 0) != -1)) {
+			fprintf(f, "\t\tcase %d: ev->code = %d; return 1;\n", c, RRM(i, 1));
+			continue;
+		}
+		for (i = 0; (ram != NULL) && (RAM(i, 0) != -1); ++i)
+			if (RAM(i, 0) == c)
+				break;
+		if ((ram != NULL) && (RAM(i, 0) != -1)) {
+			o = RAM(i, 1);
+			if ((apx[o] >= 0) || (rmax == rmin))
+				fprintf(f, "\t\tcase %d: return 0;\n", c);
+			else
+				fprintf(f, "\t\tcase %d: ev->type = EV_ABS; ev->code = %d;\n"
+						"\t\t\tif (ev->value < %d) ev->value = %d;\n"
+						"\t\t\tif (ev->value > %d) ev->value = %d;\n"
+						"\t\t\tev->value = ((ev->value - %d) * %d) / %d + %d;\n"
+						"\t\t\treturn 1;\n",
+						c, o, rmin, rmin, rmax, rmax, rmin, uo->absmax[o] - uo->absmin[o],
+						rmax - rmin, uo->absmin[o]);
+		}
+	}
+	fprintf(f, "\t\t}\n\t\treturn 1;\n");
+
+	/* ABS */
+	fprintf(f, "\tcase EV_ABS:\n\t\tswitch (ev->code) {\n");
+	for (c = 0; c <= ABS_MAX; ++c) {
+		m = ui->absmax[c] - ui->absmin[c];
+		if (kspecial(EV_ABS, c)) {
+			fprintf(f, "\t\tcase %d: return 0;\n", c);
+			continue;
+		}
+		for (i = 0; (arm != NULL) && (ARM(i, 0) != -1); ++i)
+			if (ARM(i, 0) == c)
+				break;
+		if ((arm != NULL) && (ARM(i, 0) != -1)) {
+			if (m == 0)
+				fprintf(f, "\t\tcase %d: return 0;\n", c);
+			else
+				fprintf(f, "\t\tcase %d: ev->type = EV_REL; ev->code = %d; ev->value = %d + ((ev->value - %d) * %d) / %d; return 1;\n",
+						c, ARM(i, 1), rmin, ui->absmin[c], rmax - rmin, m);
+			continue;
+		}
+		for (i = 0; (aam != NULL) && (AAM(i, 0) != -1); ++i)
+			if (AAM(i, 0) == c)
+				break;
+		if ((aam != NULL) && (AAM(i, 0) != -1)) {
+			o = AAM(i, 1);
+			if ((apx[o] >= 0) || (m == 0))
+				fprintf(f, "\t\tcase %d: return 0;\n", c);
+			else
+				fprintf(f, "\t\tcase %d: ev->code = %d; ev->value = %d + ((ev->value - %d) * %d) / %d; return 1;\n",
+						c, o, uo->absmin[o], ui->absmin[c], uo->absmax[o] - uo->absmin[o], m);
+		}
+	}
+	fprintf(f, "\t\t}\n\t\treturn 1;\n");
+
+	fprintf(f, "\t}\n\n\treturn 0;\n}\n");
+}
+
+/* Generate a remap kernel in memory, returns its hash */
+static unsigned long long khash(char **src, struct uinput_user_dev *ui, struct uinput_user_dev *uo, int rmin, int rmax)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	size_t n;
+	char *p;
+	FILE *f;
+
+	*src = NULL;
+	f = open_memstream(src, &n);
+	if (f == NULL)
+		return 0;
+	kgen(f, ui, uo, rmin, rmax);
+	fclose(f);
+
+	/* FNV-1a */
+	for (p = *src; *p != '\0'; ++p)
+		h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+
+	return h;
+}
+
+/* Build a remap kernel shared object for the current rule set */
+static int kbuild(char *file, struct uinput_user_dev *ui, struct uinput_user_dev *uo, int rmin, int rmax)
+{
+	char *src, *cc = getenv("CC"), cfile[PATH_MAX];
+	char *argv[] = { (cc != NULL)?cc:"cc", "-O2", "-shared", "-fPIC", "-o", file, cfile, NULL };
+	unsigned long long h;
+	pid_t pid;
+	FILE *f;
+	int ret, st;
+
+	h = khash(&src, ui, uo, rmin, rmax);
+	RETERN(src == NULL, "Unable to generate remap kernel");
+
+	snprintf(cfile, sizeof(cfile), "%s.c", file);
+	f = fopen(cfile, "w");
+	if (f == NULL) {
+		free(src);
+		RETERN(1, "Unable to write remap kernel source %s", cfile);
+	}
+	fprintf(f, "/* Generated by evmapd %s --compile for %s - do not edit */\n\n"
+			"#include <linux/input.h>\n\n"
+			"const unsigned long long evmapd_kernel_hash = 0x%016llxULL;\n\n%s",
+			VERSION, idev, h, src);
+	fclose(f);
+	free(src);
+
+	if (verbose)
+		info("%s -O2 -shared -fPIC -o %s %s\n", argv[0], file, cfile);
+
+	/* Run the compiler directly, the paths never go through a shell */
+	pid = fork();
+	RETERN(pid < 0, "Unable to build remap kernel %s", file);
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	ret = waitpid(pid, &st, 0);
+	RETERR((ret < 0) || !WIFEXITED(st) || (WEXITSTATUS(st) != 0), 1, EIO,
+			"Unable to build remap kernel %s", file);
+
+	info("Remap kernel %s built (config hash %016llx)\n", file, h);
+
+	return 0;
+}
+
+/* Load a remap kernel, falling back to the generic code on any mismatch */
+static void kload(char *file, struct uinput_user_dev *ui, struct uinput_user_dev *uo, int rmin, int rmax)
+{
+	unsigned long long h, *kh;
+	char *src, path[PATH_MAX];
+
+	h = khash(&src, ui, uo, rmin, rmax);
+	cfree(src);
+
+	/* A plain name would be looked up in the library path */
+	snprintf(path, sizeof(path), "%s%s", (strchr(file, '/') == NULL)?"./":"", file);
+
+	kdl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (kdl == NULL) {
+		msg("Warning: could not load remap kernel %s: %s\n", file, dlerror());
+		return;
+	}
+
+	kh = dlsym(kdl, "evmapd_kernel_hash");
+	kern = dlsym(kdl, "evmapd_kernel");
+	if ((kh == NULL) || (kern == NULL) || (*kh != h)) {
+		msg("Warning: remap kernel %s does not match this configuration\n", file);
+		kern = NULL;
+		dlclose(kdl);
+		kdl = NULL;
+		return;
+	}
+
+	if (verbose)
+		info("Loaded remap kernel %s (config hash %016llx)\n\n", file, h);
+}
+
+/* Restore the original keymap entries of the input device */
+static void kmap_restore()
+{
+	int i;
+
+	for (i = 0; i < nkmo; ++i)
+		if (ioctl(ifp, EVIOCSKEYCODE_V2, &kmo[i]) < 0)
+			msg("Warning: could not restore keymap entry %i of %s\n", i, idev);
+
+	cfree(kmo);
+	kmo = NULL;
+	nkmo = 0;
+}
+
+/* Move --key-key maps into the scancode keymap of the input device, so
+ * that the kernel remaps those keys before evmapd ever sees them. Only
+ * maps whose source and target keys need nothing else from evmapd are
+ * moved. Whatever cannot be moved stays with the event loop. */
+static int kmap_offload()
+{
+	struct input_keymap_entry ke, *e;
+	int i, j, n, ch, *cand;
+
+	if (kkm == NULL)
+		return 0;
+
+	for (n = 0; KKM(n, 0) != -1; ++n);
+	cand = calloc(n, sizeof(int));
+	RETERN(cand == NULL, "Keymap offload failed");
+
+	for (i = 0; i < n; ++i) {
+		cand[i] = !kspecial(EV_KEY, KKM(i, 0)) && !kspecial(EV_KEY, KKM(i, 1));
+		for (j = 0; j < i; ++j)
+			if (KKM(j, 0) == KKM(i, 0))
+				cand[i] = 0;
+		for (j = 0; (krm != NULL) && (KRM(j, 0) != -1); ++j)
+			if ((KRM(j, 0) == KKM(i, 1)) || (KRM(j, 1) == KKM(i, 1)))
+				cand[i] = 0;
+		for (j = 0; (kam != NULL) && (KAM(j, 0) != -1); ++j)
+			if ((KAM(j, 0) == KKM(i, 1)) || (KAM(j, 1) == KKM(i, 1)))
+				cand[i] = 0;
+	}
+
+	/* Collect the scancodes first, so that swapped keys work */
+	for (i = 0; ; ++i) {
+		memset(&ke, 0, sizeof(ke));
+		ke.flags = INPUT_KEYMAP_BY_INDEX;
+		ke.index = i;
+		if (ioctl(ifp, EVIOCGKEYCODE_V2, &ke) < 0)
+			break;
+
+		for (j = 0; j < n; ++j)
+			if (cand[j] && (KKM(j, 0) == (int)ke.keycode))
+				break;
+		if (j == n)
+			continue;
+
+		e = realloc(kmo, (nkmo + 1) * sizeof(*kmo));
+		if (e == NULL) {
+			free(cand);
+			cfree(kmo);
+			kmo = NULL;
+			nkmo = 0;
+			RETERN(1, "Keymap offload failed");
+		}
+		kmo = e;
+		kmo[nkmo] = ke;
+		kmo[nkmo].flags = 0;
+		++nkmo;
+		cand[j] = 2;
+	}
+	for (i = 0; i < n; ++i)
+		cand[i] = (cand[i] == 2);
+
+	/* A target key that stays remapped in userspace would be remapped twice */
+	do {
+		ch = 0;
+		for (i = 0; i < n; ++i)
+			for (j = 0; cand[i] && (j < n); ++j)
+				if (!cand[j] && (KKM(j, 0) == KKM(i, 1))) {
+					cand[i] = 0;
+					ch = 1;
+				}
+	} while (ch);
+
+	for (i = 0, j = 0; i < nkmo; ++i) {
+		for (ch = 0; KKM(ch, 0) != (int)kmo[i].keycode; ++ch);
+		if (cand[ch])
+			kmo[j++] = kmo[i];
+	}
+	nkmo = j;
+
+	for (i = 0; i < nkmo; ++i) {
+		ke = kmo[i];
+		for (j = 0; KKM(j, 0) != (int)kmo[i].keycode; ++j);
+		ke.keycode = KKM(j, 1);
+		if (ioctl(ifp, EVIOCSKEYCODE_V2, &ke) < 0) {
+			msg("Warning: could not update the keymap of %s: %s\n", idev, strerror(errno));
+			nkmo = i;
+			kmap_restore();
+			free(cand);
+			return 0;
+		}
+	}
+
+	if (nkmo > 0)
+		atexit(kmap_restore);
+
+	/* Drop the moved maps from the userspace rule set */
+	for (i = 0, j = 0; i <= n; ++i)
+		if ((i == n) || !cand[i]) {
+			KKM(j, 0) = KKM(i, 0);
+			KKM(j, 1) = KKM(i, 1);
+			++j;
+		}
+
+	if (verbose)
+		info("Moved %i key-key maps (%i scancodes) to the keymap of %s\n\n", n + 1 - j, nkmo, idev);
+
+	free(cand);
+	return 0;
+}
 
-int info(const char *fmt, ...)
+/* Report the runtime statistics */
+static void stats()
 {
-	va_list args;
-	int ret = 0;
+	int i;
 
-	va_start(args, fmt);
-	if (fileno(stderr) >= 0)
-		ret = vfprintf(stderr, fmt, args);
-	if (log > 1)
-		vsyslog(LOG_NOTICE, fmt, args);
-	va_end(args);
+	info("evmapd statistics for %s:\n", idev);
+	info("\tTimer jitter: %lli expirations, avg %lli us, max %lli us\n",
+			tjn, (tjn > 0)?(tjsum / tjn / 1000):0, tjmax / 1000);
+	for (i = 0; i <= KEY_MAX; ++i)
+		if (dbn[i] > 0)
+			info("\tKEY %3d: %u bounces filtered\n", i, dbn[i]);
+	if (ffn > 0)
+		info("\tForce feedback: %lli events, avg %lli us, max %lli us\n",
+				ffn, ffsum / ffn / 1000, ffmax / 1000);
+	if (rin > 0)
+		info("\tRate limit: %llu frames sent for %llu received\n", rout, rin);
+	if (ptev > 0)
+		info("\tPassthrough: %llu of %llu events\n", ptn, ptev);
+	if (upn > 0)
+		info("\tUpsampling: %llu predicted ABS samples\n", upn);
+	if (gy.mode)
+		info("\tGyro bias: %lli,%lli (1/%i units), %scalibrated\n", gy.bias[0], gy.bias[1],
+				1 << GBIAS, gy.cal?"":"not ");
+}
 
-	return ret;
+/* Statistics on demand */
+void on_usr1(int s)
+{
+	dump = 1;
 }
 
 /* PID file creation */
@@ -131,10 +1998,12 @@ static void rfree(void **v)
 /* Allow SIGTERM to cause graceful termination */
 void on_term(int s)
 {
-	int ret;
+	int i, ret;
 
 	if (detach)
 		info("evmapd %s terminating for %s\n", VERSION, idev);
+	if (verbose)
+		stats();
 
 	if (grab) {
 		ret = ioctl(ifp, EVIOCGRAB, (void *)0);
@@ -142,10 +2011,23 @@ void on_term(int s)
 			msg("Warning: could not release %s\n", idev);
 	}
 
-	if (log)
+	/* Before the input device is closed, atexit() would be too late */
+	kmap_restore();
+
+	if (syslg)
 		closelog();
 	close(ifp);
 	close(ofp);
+	close(tfd);
+
+	if (st != NULL)
+		munmap(st, sizeof(*st));
+	if (kdl != NULL)
+		dlclose(kdl);
+	if (stfile != NULL) {
+		unlink(stfile);
+		free(stfile);
+	}
 
 	cfree(idev);
 	cfree(kkm);
@@ -157,7 +2039,13 @@ void on_term(int s)
 	cfree(akm);
 	cfree(arm);
 	cfree(aam);
+	cfree(llm);
+	cfree(ssm);
 	rfree((void **)nm);
+	for (i = 0; i <= REL_MAX; ++i)
+		cfree(rcv[i]);
+	for (i = 0; i <= ABS_MAX; ++i)
+		cfree(acv[i]);
 
 	if (pidfile != NULL) {
 		unlink(pidfile);
@@ -232,6 +2120,227 @@ static int str_int(char **s, int **r, char *conv, int col)
 
 
 
+/* Update the cached scale after a change of the calibrated range */
+static void rescale(struct abscal *a)
+{
+	a->crng = 0;
+	if ((a->rmax > a->rmin) && ((a->nrng == 0) || ((long)(a->rmax - a->rmin) * (long)a->nrng >= a->irng)))
+		a->crng = a->rmax - a->rmin;
+}
+
+/* ABS axis auto-calibration */
+static int normalise(struct abscal *a, int v)
+{
+	if (a->rdy) {
+		/* Spike protection */
+		if (a->nspk > 0) {
+			if (labs((long)v - (long)a->last) * (long)(a->nspk) > (long)a->irng)
+				return v;
+			a->last = v;
+		}
+
+		/* Auto-calibration reset code */
+		if (a->nrst > 0) {
+			if (a->acnt > 0) {
+				++a->acnt;
+
+				if (v < a->amin)
+					a->amin = v;
+				if (v > a->amax)
+					a->amax = v;
+
+				if (a->acnt >= a->nrst) {
+					if ((a->nrng == 0) || ((long)(a->amax - a->amin) * (long)a->nrng >= a->irng)) {
+						a->rmin = a->amin;
+						a->rmax = a->amax;
+						a->amin = 0;
+						a->amax = 0;
+						a->acnt = 0;
+						rescale(a);
+					} else {
+						a->acnt = a->nrst - 1;
+					}
+				}
+			} else {
+				if (a->amin == 0) {
+					a->amin = v;
+				} else {
+					if (a->amin < v) {
+						a->amax = v;
+						++a->acnt;
+					} else if (a->amin > v) {
+						a->amax = a->amin;
+						a->amin = v;
+						++a->acnt;
+					}
+				}
+			}
+		}
+
+		if (v < a->rmin) {
+			a->rmin = v;
+			rescale(a);
+		}
+		if (v > a->rmax) {
+			a->rmax = v;
+			rescale(a);
+		}
+
+		/* The actual auto-calibration formula */
+		if (a->crng > 0)
+			v = ((long)a->irng * (long)(v - a->rmin)) / a->crng + a->imin;
+	} else {
+		/* Ignore initial events */
+		if (a->ign > 0) {
+			--a->ign;
+			return v;
+		}
+
+		if (a->rmin == 0) {
+			a->rmin = v;
+		} else {
+			/* Spike protection */
+			if (a->nspk > 0) {
+				if (labs((long)v - (long)a->rmin) * (long)(a->nspk) > (long)a->irng)
+					return v;
+				a->last = v;
+			}
+
+			if (a->rmin < v) {
+				a->rmax = v;
+				a->rdy = 1;
+			} else if (a->rmin > v) {
+				a->rmax = a->rmin;
+				a->rmin = v;
+				a->rdy = 1;
+			}
+			rescale(a);
+		}
+	}
+
+	return v;
+}
+
+/* Move the quantile buckets so that they bracket their target counts */
+static void qadjust(struct absqnt *q)
+{
+	int tl = ((long)q->tot * q->plo) / 1000;
+	int th = ((long)q->tot * (1000 - q->phi)) / 1000;
+
+	while ((q->ql > 0) && (q->bl > tl)) {
+		--q->ql;
+		q->bl -= q->h[q->ql];
+	}
+	while ((q->ql < QBUCKETS - 1) && (q->bl + q->h[q->ql] <= tl)) {
+		q->bl += q->h[q->ql];
+		++q->ql;
+	}
+
+	while ((q->qh < QBUCKETS - 1) && (q->ah > th)) {
+		++q->qh;
+		q->ah -= q->h[q->qh];
+	}
+	while ((q->qh > 0) && (q->ah + q->h[q->qh] <= th)) {
+		q->ah += q->h[q->qh];
+		--q->qh;
+	}
+}
+
+/* Halve the histogram so that old samples fade out */
+static void qdecay(struct absqnt *q)
+{
+	int i;
+
+	q->tot = 0;
+	q->bl = 0;
+	q->ah = 0;
+	for (i = 0; i < QBUCKETS; ++i) {
+		q->h[i] >>= 1;
+		q->tot += q->h[i];
+		if (i < q->ql)
+			q->bl += q->h[i];
+		if (i > q->qh)
+			q->ah += q->h[i];
+	}
+}
+
+/* ABS axis auto-calibration using streaming quantile estimation */
+static int normalise_q(struct abscal *a, struct absqnt *q, int v)
+{
+	int b, lo, hi, tl, th;
+
+	/* Ignore initial events */
+	if (a->ign > 0) {
+		--a->ign;
+		return v;
+	}
+
+	/* Spike protection */
+	if ((a->nspk > 0) && (q->tot > 0))
+		if (labs((long)v - (long)a->last) * (long)(a->nspk) > (long)a->irng)
+			return v;
+	a->last = v;
+
+	/* Histogram update */
+	b = ((long)(v - a->imin) * QBUCKETS) / (a->irng + 1);
+	if (b < 0)
+		b = 0;
+	if (b >= QBUCKETS)
+		b = QBUCKETS - 1;
+
+	++q->h[b];
+	++q->tot;
+	if (b < q->ql)
+		++q->bl;
+	if (b > q->qh)
+		++q->ah;
+
+	if (q->tot >= q->win)
+		qdecay(q);
+	qadjust(q);
+
+	if (q->tot < QWARM)
+		return v;
+
+	/* Interpolate the percentile values within their buckets */
+	tl = ((long)q->tot * q->plo) / 1000;
+	th = ((long)q->tot * (1000 - q->phi)) / 1000;
+	lo = a->imin + ((long)q->ql * (a->irng + 1)) / QBUCKETS;
+	if (q->h[q->ql] > 0)
+		lo = a->imin + ((long)(q->ql * q->h[q->ql] + (tl - q->bl)) * (a->irng + 1)) /
+				((long)QBUCKETS * q->h[q->ql]);
+	hi = a->imin + ((long)(q->qh + 1) * (a->irng + 1)) / QBUCKETS - 1;
+	if (q->h[q->qh] > 0)
+		hi = a->imin + ((long)((q->qh + 1) * q->h[q->qh] - (th - q->ah)) * (a->irng + 1)) /
+				((long)QBUCKETS * q->h[q->qh]) - 1;
+
+	/* Glide towards the new range rather than jump to it */
+	if (!a->rdy) {
+		q->slo = lo * 256;
+		q->shi = hi * 256;
+		a->rdy = 1;
+	} else {
+		q->slo += (lo * 256 - q->slo) / QSMOOTH;
+		q->shi += (hi * 256 - q->shi) / QSMOOTH;
+	}
+
+	a->rmin = q->slo / 256;
+	a->rmax = q->shi / 256;
+	rescale(a);
+
+	if (a->crng > 0) {
+		v = ((long)a->irng * (long)(v - a->rmin)) / a->crng + a->imin;
+		if (v < a->imin)
+			v = a->imin;
+		if (v > a->imin + a->irng)
+			v = a->imin + a->irng;
+	}
+
+	return v;
+}
+
+
+
 #define VERTRIPLET(v)		(v >> 16), (v >> 8) & 0xff, (v & 0xff)
 
 #define USAGE			"evmapd Version " VERSION "\n" \
@@ -245,6 +2354,10 @@ static int str_int(char **s, int **r, char *conv, int col)
 				"        -o, --odev <device>	Specify the device to use for output\n" \
 				"        -p, --pidfile <file>	Use a file to store the PID\n" \
 				"        -q, --quiet		Suppress all console messages\n" \
+				"        -s, --state <file>	Export the output device state to a file\n" \
+				"        -C, --compile <file>	Build a remap kernel for this configuration\n" \
+				"        -k, --kernel <file>	Use a remap kernel built with --compile\n" \
+				"        -K, --keymap		Move --key-key maps into the input device keymap\n" \
 				"        -v, --verbose		Emit more verbose messages\n" \
 				"        -V, --version		Show version information\n" \
 				"\n" \
@@ -258,10 +2371,22 @@ static int str_int(char **s, int **r, char *conv, int col)
 				"        --abs-key <from-abs>:<to-min-key>,<to-max-key>\n" \
 				"        --abs-rel <from-abs>:<to-rel>\n" \
 				"        --abs-abs <from-abs>:<to-abs>\n" \
+				"        --led-led <from-led>:<to-led>\n" \
+				"        --snd-snd <from-snd>:<to-snd>\n" \
 				"\n" \
-				"    <*-key>, <*-rel> and <*-abs> are numeric event codes.\n" \
+				"    <*-key>, <*-rel>, <*-abs>, <*-led> and <*-snd> are numeric\n" \
+				"    event codes.\n" \
 				"    Multiple remapping options may be specified.\n" \
 				"\n" \
+				"    With -K, --key-key maps that need nothing else from evmapd\n" \
+				"    are applied by the scancode keymap of the input device. This\n" \
+				"    changes the keymap for every reader of the device until\n" \
+				"    evmapd exits on SIGTERM, SIGINT or SIGHUP; if it is killed\n" \
+				"    otherwise, the device keeps the changed keymap until it is\n" \
+				"    plugged in again. The events still pass through evmapd and\n" \
+				"    the output device; only the per-event map lookup is saved.\n" \
+				"    -K cannot be combined with --compile or --kernel.\n" \
+				"\n" \
 				"    Default values:\n" \
 				"        --absconf <default-abs-min>,<default-abs-max>\n" \
 				"        --relconf <default-rel-min>,<default-rel-max>\n" \
@@ -269,6 +2394,8 @@ static int str_int(char **s, int **r, char *conv, int col)
 				"    ABS event normalisation options:\n" \
 				"        --norm <abs>[,<abs>...]\n" \
 				"        --normconf <ignore>[,<range>[,<rst>[,<spike>[,<min-spike>]]]]\n" \
+				"        --normaxis <abs>:<ignore>[,<range>[,<rst>[,<spike>[,<min-spike>]]]]\n" \
+				"        --normquant <abs>[:<low>,<high>]\n" \
 				"\n" \
 				"        <abs>       Input axis to normalise.\n" \
 				"\n" \
@@ -294,6 +2421,130 @@ static int str_int(char **s, int **r, char *conv, int col)
 				"\n" \
 				"    The --norm option may be used multiple times to specify more\n" \
 				"    than one ABS axis to perform normalisation on.\n" \
+				"\n" \
+				"    The --normconf values apply to all axis given with --norm. Use\n" \
+				"    --normaxis to normalise an axis with its own set of values;\n" \
+				"    any value left out is taken from --normconf.\n" \
+				"\n" \
+				"    --normquant switches an axis to quantile calibration: instead\n" \
+				"    of the raw extremes, the <low> and <high> percentiles (in per\n" \
+				"    mille, default 10 and 990) of the recent input values are\n" \
+				"    tracked and the range glides smoothly towards them. Here <rst>\n" \
+				"    is the number of events after which old samples lose half of\n" \
+				"    their weight (default 4096).\n" \
+				"\n" \
+				"    Multitouch options:\n" \
+				"        --mt-xform <swap>[,<invert-x>[,<invert-y>]]\n" \
+				"        --mt-abs <abs-x>,<abs-y>\n" \
+				"        --mt-rel <rel-x>,<rel-y>[,<div>]\n" \
+				"        --mt-scroll <rel-v>,<rel-h>[,<div>]\n" \
+				"\n" \
+				"    Slot positions are tracked across frames for up to 16 touches.\n" \
+				"    --mt-xform swaps and/or inverts the position of every slot\n" \
+				"    and of the single-touch X/Y axis.\n" \
+				"    The other options turn the device into a single-touch ABS\n" \
+				"    device, a REL pointer, or a pointer that scrolls when two or\n" \
+				"    more fingers move. <div> is the number of position units per\n" \
+				"    output REL unit. These consume the multitouch axis and the\n" \
+				"    single-touch emulation: X, Y, pressure, BTN_TOUCH and the\n" \
+				"    finger count keys BTN_TOOL_FINGER, _DOUBLETAP, _TRIPLETAP,\n" \
+				"    _QUADTAP and _QUINTTAP.\n" \
+				"\n" \
+				"    Axis pair options:\n" \
+				"        --pair <abs-x>,<abs-y>:<deadzone>[,<rotation>[,<circle>]]\n" \
+				"\n" \
+				"    Output ABS axis given as a pair are transformed together at\n" \
+				"    the end of each input frame: a square stick gate is mapped to\n" \
+				"    a circle if <circle> is non-zero, the stick is rotated by\n" \
+				"    <rotation> degrees and a radial deadzone of <deadzone> per\n" \
+				"    mille of the range is applied. Up to 8 pairs may be given.\n" \
+				"\n" \
+				"    Response curve options:\n" \
+				"        --rel-curve <from-rel>:<type>,<a>[,<b>[,<c>]]\n" \
+				"        --abs-curve <from-abs>:<type>,<a>[,<b>[,<c>]]\n" \
+				"\n" \
+				"    Apply a response curve to a --rel-rel or --abs-rel mapping.\n" \
+				"    <a> and <b> are gains in percent:\n" \
+				"        0   linear, gain <a>\n" \
+				"        1   power, gain <a> at <c>, exponent <b>/100\n" \
+				"        2   piecewise linear, gain <a> up to <c>, <b> above it\n" \
+				"        3   S-curve, gain <a> well below <c>, <b> well above it\n" \
+				"    For --rel-curve the input is the REL value. For --abs-curve it\n" \
+				"    is the deflection from the centre in per mille and the output\n" \
+				"    is in per mille of the --relconf range. Fractional output is\n" \
+				"    carried over to the next event.\n" \
+				"\n" \
+				"    Timed key actions:\n" \
+				"        --chord <key-a>,<key-b>:<to-key>[,<window>]\n" \
+				"        --tap-hold <key>:<tap-key>,<hold-key>[,<time>]\n" \
+				"        --macro <key>:<delay>:<to-key>[,<to-key>...]\n" \
+				"        --autofire <key>:<rate>[,<to-key>]\n" \
+				"\n" \
+				"    --chord presses <to-key> when both keys go down within\n" \
+				"    <window> ms (default 50), otherwise the keys act as themselves.\n" \
+				"    --tap-hold sends <tap-key> when <key> is released within <time>\n" \
+				"    ms (default 200) and holds <hold-key> when it is held longer.\n" \
+				"    --macro taps up to 16 keys in sequence, one press or release\n" \
+				"    every <delay> ms. --autofire repeats a key <rate> times per\n" \
+				"    second while it is held. Send SIGUSR1 to report the timer\n" \
+				"    jitter and other statistics.\n" \
+				"\n" \
+				"    Debouncing options:\n" \
+				"        --debounce <key>:<window>\n" \
+				"\n" \
+				"    Let the first edge of <key> through at once and drop any\n" \
+				"    opposite edge within <window> ms of it. If the key has settled\n" \
+				"    in the other state when the window is over, that state is sent\n" \
+				"    then. The number of bounces filtered is reported on SIGUSR1.\n" \
+				"\n" \
+				"    Upsampling options:\n" \
+				"        --upsample <abs>:<rate>[,<overshoot>]\n" \
+				"\n" \
+				"    Send <rate> samples per second of the output axis <abs> by\n" \
+				"    extrapolating the last two real samples, using the input\n" \
+				"    event timestamps. The prediction reaches at most one input\n" \
+				"    period ahead and is kept within <overshoot> percent (default\n" \
+				"    50) of the last step from the last real value. Real samples\n" \
+				"    always replace the prediction, and the axis falls back to\n" \
+				"    the last real value when the input misses a report.\n" \
+				"\n" \
+				"    Motion sensor options:\n" \
+				"        --gyro-rel <yaw>,<pitch>:<rel-x>,<rel-y>[,<sens>]\n" \
+				"        --gyro-abs <yaw>,<pitch>:<abs-x>,<abs-y>[,<range>]\n" \
+				"        --gyro-accel <up>,<forward>[,<weight>]\n" \
+				"        --gyro-cal <threshold>[,<time>]\n" \
+				"\n" \
+				"    Integrate the <yaw> and <pitch> gyro axes of a motion sensor\n" \
+				"    into <sens> REL units per degree of rotation (default 10), or\n" \
+				"    into an ABS stick position, reaching full deflection at\n" \
+				"    <range> degrees (default 45). The gyro units per degree/s are\n" \
+				"    taken from the axis resolution. --gyro-accel corrects the ABS\n" \
+				"    pitch angle towards atan2(<forward>, <up>) from the\n" \
+				"    accelerometer, by <weight> per mille per report (default 5,\n" \
+				"    negative to invert the accelerometer angle). The gyro bias is\n" \
+				"    measured whenever each axis stays within <threshold>\n" \
+				"    degrees/s (default 2, 0 disables) of its own value at the\n" \
+				"    start of the rest, and of its current bias once one is known,\n" \
+				"    for <time> ms (default 500). The bias is reported on SIGUSR1.\n" \
+				"\n" \
+				"    Output rate options:\n" \
+				"        --rate <hz>\n" \
+				"\n" \
+				"    Send at most <hz> output frames per second. ABS values of\n" \
+				"    frames that arrive faster are merged, keeping the latest\n" \
+				"    value, and REL values are summed. MSC events such as\n" \
+				"    timestamps keep the latest value. The merged frame is sent\n" \
+				"    when the next one is due. Other events are sent at once, and\n" \
+				"    key and switch changes end the frame early, with anything\n" \
+				"    merged so far.\n" \
+				"    Multitouch frames are never merged.\n" \
+				"\n" \
+				"    Force feedback effects, LED and sound events written to the\n" \
+				"    output device are forwarded to the input device, if it can\n" \
+				"    be opened for writing. LED and sound codes are mapped back\n" \
+				"    through --led-led and --snd-snd. Sound events from the input\n" \
+				"    device are dropped then, as they are the echo of those\n" \
+				"    forwarded. The force feedback delay is reported on SIGUSR1.\n" \
 				"\n"
 
 
@@ -304,14 +2555,6 @@ static int usage(int r)
 	return r;
 }
 
-#define EV_EV			0
-
-#define LEN(t, b)		(((b - 1) / (sizeof(t) * 8)) + 1)
-#define POS(c, b)		(b / (sizeof((c)[0]) * 8))
-#define OFF(c, b)		(b % (sizeof((c)[0]) * 8))
-#define GET(c, b)		((c[POS(c, b)] >> OFF(c, b)) & 1)
-#define SET(c, b, v)		(c)[POS(c, b)] = (((c)[POS(c, b)] & ~(1 << OFF(c, b))) | (((v) > 0) << OFF(c, b)))
-
 #if DEBUG
 #define INQ(i, m)		ret = ioctl(ifp, i, m); \
 				RETERN(ret < 0, "Unable to query input device %s (" #i ") [%i]", idev, __LINE__)
@@ -358,8 +2601,6 @@ int main(int argc, char **argv)
 	int amin = -32767, amax = 32767, rmin = -128, rmax = 128;
 	int nign = 0, nrng = 0, nrst = 0, nspk = 0, nspkmin = 2; 
 
-	char *odev = UINPUT_DEVICE;
-
 	int iver;
 	char iphys[256];
 	struct uinput_user_dev uidev = {};
@@ -378,13 +2619,22 @@ int main(int argc, char **argv)
 
 	char **kkmap = NULL, **krmap = NULL, **kamap = NULL, **rkmap = NULL, **rrmap = NULL;
 	char **ramap = NULL, **akmap = NULL, **armap = NULL, **aamap = NULL;
-	char *acfg = NULL, *ncfg = NULL, *rcfg = NULL;
+	char **llmap = NULL, **ssmap = NULL;
+	char *acfg = NULL, *ncfg = NULL, *rcfg = NULL, **nacfg = NULL, **nqcfg = NULL;
+	char *cfile = NULL, *kfile = NULL;
+	char *mxcfg = NULL, *macfg = NULL, *mrcfg = NULL, *mscfg = NULL, **apcfg = NULL;
+	char **rccfg = NULL, **accfg = NULL;
+	char **chcfg = NULL, **thcfg = NULL, **mccfg = NULL, **afcfg = NULL, **dbcfg = NULL;
+	char **upcfg = NULL, *grcfg = NULL, *gacfg = NULL, *gxcfg = NULL, *gccfg = NULL;
+	int ares[ABS_MAX + 1], gthr = 2, gstill = 500, rhz = 0;
+	int mclk = 0;
 
 	struct cfg_option options[] = {
 		{"daemon",	'D',	NULL, CFG_BOOL,		(void *) &detach,	0},
 		{"grab",	'g',	NULL, CFG_BOOL,		(void *) &grab,		0},
 		{"help",	'h',	NULL, CFG_BOOL,		(void *) &help,		0},
-		{"log",		'l',	NULL, CFG_BOOL,		(void *) &log,		0},
+		{"keymap",	'K',	NULL, CFG_BOOL,		(void *) &keymap,	0},
+		{"log",		'l',	NULL, CFG_BOOL,		(void *) &syslg,	0},
 		{"quiet",	'q',	NULL, CFG_BOOL,		(void *) &quiet,	0},
 		{"verbose",	'v',	NULL, CFG_BOOL,		(void *) &verbose,	0},
 		{"version",	'V',	NULL, CFG_BOOL,		(void *) &version,	0},
@@ -392,6 +2642,9 @@ int main(int argc, char **argv)
 		{"idev",	'i',	NULL, CFG_STR,		(void *) &idev,		0},
 		{"odev",	'o',	NULL, CFG_STR,		(void *) &odev,		0},
 		{"pidfile",	'p',	NULL, CFG_STR,		(void *) &pidfile,	0},
+		{"state",	's',	NULL, CFG_STR,		(void *) &stfile,	0},
+		{"compile",	'C',	NULL, CFG_STR,		(void *) &cfile,	0},
+		{"kernel",	'k',	NULL, CFG_STR,		(void *) &kfile,	0},
 
 		{"key-key",	0,	NULL, CFG_STR+CFG_MV,	(void *) &kkmap,	0},
 		{"key-rel",	0,	NULL, CFG_STR+CFG_MV,	(void *) &krmap,	0},
@@ -402,12 +2655,42 @@ int main(int argc, char **argv)
 		{"abs-key",	0,	NULL, CFG_STR+CFG_MV,	(void *) &akmap,	0},
 		{"abs-rel",	0,	NULL, CFG_STR+CFG_MV,	(void *) &armap,	0},
 		{"abs-abs",	0,	NULL, CFG_STR+CFG_MV,	(void *) &aamap,	0},
+		{"led-led",	0,	NULL, CFG_STR+CFG_MV,	(void *) &llmap,	0},
+		{"snd-snd",	0,	NULL, CFG_STR+CFG_MV,	(void *) &ssmap,	0},
 
 		{"absconf",	0,	NULL, CFG_STR,		(void *) &acfg,		0},
 		{"relconf",	0,	NULL, CFG_STR,		(void *) &rcfg,		0},
 
 		{"norm",	0,	NULL, CFG_INT+CFG_MS,	(void *) &nm,		0},
 		{"normconf",	0,	NULL, CFG_STR,		(void *) &ncfg,		0},
+		{"normaxis",	0,	NULL, CFG_STR+CFG_MV,	(void *) &nacfg,	0},
+		{"normquant",	0,	NULL, CFG_STR+CFG_MV,	(void *) &nqcfg,	0},
+
+		{"mt-xform",	0,	NULL, CFG_STR,		(void *) &mxcfg,	0},
+		{"mt-abs",	0,	NULL, CFG_STR,		(void *) &macfg,	0},
+		{"mt-rel",	0,	NULL, CFG_STR,		(void *) &mrcfg,	0},
+		{"mt-scroll",	0,	NULL, CFG_STR,		(void *) &mscfg,	0},
+
+		{"pair",	0,	NULL, CFG_STR+CFG_MV,	(void *) &apcfg,	0},
+
+		{"rel-curve",	0,	NULL, CFG_STR+CFG_MV,	(void *) &rccfg,	0},
+		{"abs-curve",	0,	NULL, CFG_STR+CFG_MV,	(void *) &accfg,	0},
+
+		{"chord",	0,	NULL, CFG_STR+CFG_MV,	(void *) &chcfg,	0},
+		{"tap-hold",	0,	NULL, CFG_STR+CFG_MV,	(void *) &thcfg,	0},
+		{"macro",	0,	NULL, CFG_STR+CFG_MV,	(void *) &mccfg,	0},
+		{"autofire",	0,	NULL, CFG_STR+CFG_MV,	(void *) &afcfg,	0},
+
+		{"debounce",	0,	NULL, CFG_STR+CFG_MV,	(void *) &dbcfg,	0},
+
+		{"upsample",	0,	NULL, CFG_STR+CFG_MV,	(void *) &upcfg,	0},
+
+		{"rate",	0,	NULL, CFG_INT,		(void *) &rhz,		0},
+
+		{"gyro-rel",	0,	NULL, CFG_STR,		(void *) &grcfg,	0},
+		{"gyro-abs",	0,	NULL, CFG_STR,		(void *) &gacfg,	0},
+		{"gyro-accel",	0,	NULL, CFG_STR,		(void *) &gxcfg,	0},
+		{"gyro-cal",	0,	NULL, CFG_STR,		(void *) &gccfg,	0},
 
 		CFG_END_OF_LIST
 	};
@@ -434,6 +2717,10 @@ int main(int argc, char **argv)
 		return usage(EINVAL);
 	}
 
+	/* A remap kernel would undo the maps moved into the keymap */
+	RETERR(keymap && ((cfile != NULL) || (kfile != NULL)), 1, EINVAL,
+			"--keymap cannot be used with --compile or --kernel");
+
 	/* Map parsing */
 	STRINT(kkmap, kkm, "%i:%i", 2);
 	STRINT(krmap, krm, "%i,%i:%i", 3);
@@ -444,6 +2731,8 @@ int main(int argc, char **argv)
 	STRINT(akmap, akm, "%i:%i,%i", 3);
 	STRINT(armap, arm, "%i:%i", 2);
 	STRINT(aamap, aam, "%i:%i", 2);
+	STRINT(llmap, llm, "%i:%i", 2);
+	STRINT(ssmap, ssm, "%i:%i", 2);
 
 	/* Fine-tuning controls */
 	if (acfg != NULL) {
@@ -467,18 +2756,295 @@ int main(int argc, char **argv)
 
 
 	/* Setup ABS auto-calibration code */
-	enum { IGN, RDY, RMIN, RMAX, ACNT, AMIN, AMAX, LAST };
-	int ac[ABS_MAX + 1][8];
 	memset(ac, 0, sizeof(ac));
-	for (i = 0; i <= ABS_MAX; ++i) {
-		ac[i][IGN] = nign;
+	for (i = 0; (nm != NULL) && (nm[i] != NULL); ++i) {
+		j = *(nm[i]);
+		RETERR((j < 0) || (j > ABS_MAX), 1, EINVAL, "Invalid normalised ABS axis %i", j);
+		ac[j].norm = NRM_RANGE;
+		ac[j].ign = nign;
+		ac[j].nrng = nrng;
+		ac[j].nrst = nrst;
+		ac[j].nspk = nspk;
+		ac[j].nspkmin = nspkmin;
+	}
+	rfree((void **)nm);
+	nm = NULL;
+
+	for (i = 0; (nacfg != NULL) && (nacfg[i] != NULL); ++i) {
+		int c[6] = { -1, nign, nrng, nrst, nspk, nspkmin };
+
+		ret = sscanf(nacfg[i], "%i:%i,%i,%i,%i,%i", &c[0], &c[1], &c[2], &c[3], &c[4], &c[5]);
+		RETERR(ret < 2, ret >= 0, EINVAL, "Could not parse normaxis parameters %s", nacfg[i]);
+		RETERR((c[0] < 0) || (c[0] > ABS_MAX), 1, EINVAL, "Invalid normalised ABS axis %i", c[0]);
+		for (j = 1; j < 6; ++j)
+			NONEG(c[j]);
+
+		ac[c[0]].norm = NRM_RANGE;
+		ac[c[0]].ign = c[1];
+		ac[c[0]].nrng = c[2];
+		ac[c[0]].nrst = c[3];
+		ac[c[0]].nspk = c[4];
+		ac[c[0]].nspkmin = c[5];
+	}
+	rfree((void **)nacfg);
+
+	memset(aq, 0, sizeof(aq));
+	for (i = 0; (nqcfg != NULL) && (nqcfg[i] != NULL); ++i) {
+		int c[3] = { -1, 10, 990 };
+
+		ret = sscanf(nqcfg[i], "%i:%i,%i", &c[0], &c[1], &c[2]);
+		RETERR(ret < 1, ret >= 0, EINVAL, "Could not parse normquant parameters %s", nqcfg[i]);
+		RETERR((c[0] < 0) || (c[0] > ABS_MAX), 1, EINVAL, "Invalid normalised ABS axis %i", c[0]);
+		RETERR((c[1] < 0) || (c[1] >= c[2]) || (c[2] > 1000), 1, EINVAL,
+				"Invalid normquant percentiles %i,%i", c[1], c[2]);
+
+		if (ac[c[0]].norm == NRM_NONE) {
+			ac[c[0]].ign = nign;
+			ac[c[0]].nrng = nrng;
+			ac[c[0]].nrst = nrst;
+			ac[c[0]].nspk = nspk;
+			ac[c[0]].nspkmin = nspkmin;
+		}
+		ac[c[0]].norm = NRM_QUANT;
+
+		aq[c[0]].plo = c[1];
+		aq[c[0]].phi = c[2];
+		aq[c[0]].qh = QBUCKETS - 1;
+		aq[c[0]].win = (ac[c[0]].nrst > 0)?(2 * ac[c[0]].nrst):QWIN;
+	}
+	rfree((void **)nqcfg);
+
+	/* Multitouch controls */
+	if (mxcfg != NULL) {
+		ret = sscanf(mxcfg, "%i,%i,%i", &mtxf[0], &mtxf[1], &mtxf[2]);
+		RETERR(ret < 1, ret >= 0, EINVAL, "Could not parse mt-xform parameters");
+		free(mxcfg);
+		mton = 1;
+	}
+	if (macfg != NULL) {
+		ret = sscanf(macfg, "%i,%i", &mtabs[0], &mtabs[1]);
+		RETERR(ret < 2, ret >= 0, EINVAL, "Could not parse mt-abs parameters");
+		free(macfg);
+		mton = mtcnv = 1;
+	}
+	if (mrcfg != NULL) {
+		ret = sscanf(mrcfg, "%i,%i,%i", &mtrel[0], &mtrel[1], &mtrel[2]);
+		RETERR((ret < 2) || (mtrel[2] == 0), ret >= 0, EINVAL, "Could not parse mt-rel parameters");
+		free(mrcfg);
+		mton = mtcnv = 1;
+	}
+	if (mscfg != NULL) {
+		ret = sscanf(mscfg, "%i,%i,%i", &mtscr[0], &mtscr[1], &mtscr[2]);
+		RETERR((ret < 2) || (mtscr[2] == 0), ret >= 0, EINVAL, "Could not parse mt-scroll parameters");
+		free(mscfg);
+		mton = mtcnv = 1;
+	}
+	for (i = 0; i < MT_SLOTS; ++i)
+		mt[i].id = -1;
+
+	/* Axis pairs */
+	memset(apx, -1, sizeof(apx));
+	for (i = 0; (apcfg != NULL) && (apcfg[i] != NULL); ++i) {
+		int c[5] = { -1, -1, 0, 0, 0 };
+		double a;
+
+		RETERR(npair >= PAIRS, 1, EINVAL, "Too many axis pairs");
+		ret = sscanf(apcfg[i], "%i,%i:%i,%i,%i", &c[0], &c[1], &c[2], &c[3], &c[4]);
+		RETERR(ret < 3, ret >= 0, EINVAL, "Could not parse pair parameters %s", apcfg[i]);
+		RETERR((c[0] < 0) || (c[0] > ABS_MAX) || (c[1] < 0) || (c[1] > ABS_MAX) || (c[0] == c[1]) ||
+				(apx[c[0]] >= 0) || (apx[c[1]] >= 0), 1, EINVAL, "Invalid axis pair %s", apcfg[i]);
+		RETERR((c[2] < 0) || (c[2] >= 1000), 1, EINVAL, "Invalid pair deadzone %i", c[2]);
+
+		a = c[3] * M_PI / 180;
+		ap[npair].x = c[0];
+		ap[npair].y = c[1];
+		ap[npair].dz = (c[2] * QONE) / 1000;
+		ap[npair].cs = lround(cos(a) * QONE);
+		ap[npair].sn = lround(sin(a) * QONE);
+		ap[npair].circ = c[4];
+		apx[c[0]] = apx[c[1]] = npair;
+		++npair;
+	}
+	rfree((void **)apcfg);
+
+	for (i = 0; i <= QSQRT; ++i)
+		sqtab[i] = lround(sqrt(1.0 - ((double)i * i) / (2.0 * QSQRT * QSQRT)) * QONE);
+
+	/* Response curves */
+	for (i = 0; (rccfg != NULL) && (rccfg[i] != NULL); ++i) {
+		int c[5] = { -1, 0, 100, 100, 0 };
+
+		ret = sscanf(rccfg[i], "%i:%i,%i,%i,%i", &c[0], &c[1], &c[2], &c[3], &c[4]);
+		RETERR(ret < 3, ret >= 0, EINVAL, "Could not parse rel-curve parameters %s", rccfg[i]);
+		RETERR((c[0] < 0) || (c[0] > REL_MAX) || (rcv[c[0]] != NULL), 1, EINVAL, "Invalid rel-curve axis %i", c[0]);
+		RETERR((c[1] < CRV_LINEAR) || (c[1] > CRV_SCURVE), 1, EINVAL, "Invalid curve type %i", c[1]);
+		rcv[c[0]] = curve_tab(&c[1], 0);
+		RETERN(rcv[c[0]] == NULL, "Could not allocate curve table");
+	}
+	rfree((void **)rccfg);
+
+	for (i = 0; (accfg != NULL) && (accfg[i] != NULL); ++i) {
+		int c[5] = { -1, 0, 100, 100, 0 };
+
+		ret = sscanf(accfg[i], "%i:%i,%i,%i,%i", &c[0], &c[1], &c[2], &c[3], &c[4]);
+		RETERR(ret < 3, ret >= 0, EINVAL, "Could not parse abs-curve parameters %s", accfg[i]);
+		RETERR((c[0] < 0) || (c[0] > ABS_MAX) || (acv[c[0]] != NULL), 1, EINVAL, "Invalid abs-curve axis %i", c[0]);
+		RETERR((c[1] < CRV_LINEAR) || (c[1] > CRV_SCURVE), 1, EINVAL, "Invalid curve type %i", c[1]);
+		acv[c[0]] = curve_tab(&c[1], 1);
+		RETERN(acv[c[0]] == NULL, "Could not allocate curve table");
+	}
+	rfree((void **)accfg);
+
+	/* Timed key actions */
+	memset(actk, -1, sizeof(actk));
+	for (i = 0; (chcfg != NULL) && (chcfg[i] != NULL); ++i) {
+		int c[4] = { -1, -1, -1, 50 };
+		struct action *a;
+
+		ret = sscanf(chcfg[i], "%i,%i:%i,%i", &c[0], &c[1], &c[2], &c[3]);
+		RETERR(ret < 3, ret >= 0, EINVAL, "Could not parse chord parameters %s", chcfg[i]);
+		a = act_new(ACT_CHORD, c[0], c[1]);
+		RETERR(a == NULL, 1, EINVAL, "Invalid chord %s", chcfg[i]);
+		a->out[0] = c[2];
+		a->nout = 1;
+		a->per = c[3] * (NSEC / 1000);
+	}
+	rfree((void **)chcfg);
+
+	for (i = 0; (thcfg != NULL) && (thcfg[i] != NULL); ++i) {
+		int c[4] = { -1, -1, -1, 200 };
+		struct action *a;
+
+		ret = sscanf(thcfg[i], "%i:%i,%i,%i", &c[0], &c[1], &c[2], &c[3]);
+		RETERR(ret < 3, ret >= 0, EINVAL, "Could not parse tap-hold parameters %s", thcfg[i]);
+		a = act_new(ACT_TAPHOLD, c[0], -1);
+		RETERR(a == NULL, 1, EINVAL, "Invalid tap-hold key %s", thcfg[i]);
+		a->out[0] = c[1];
+		a->out[1] = c[2];
+		a->nout = 2;
+		a->per = c[3] * (NSEC / 1000);
 	}
+	rfree((void **)thcfg);
+
+	for (i = 0; (mccfg != NULL) && (mccfg[i] != NULL); ++i) {
+		int c[2] = { -1, 0 }, n = 0;
+		struct action *a;
+		char *p, *e;
+
+		ret = sscanf(mccfg[i], "%i:%i:%n", &c[0], &c[1], &n);
+		RETERR((ret < 2) || (n == 0) || (c[1] <= 0), ret >= 0, EINVAL, "Could not parse macro parameters %s", mccfg[i]);
+		a = act_new(ACT_MACRO, c[0], -1);
+		RETERR(a == NULL, 1, EINVAL, "Invalid macro key %s", mccfg[i]);
+		a->per = c[1] * (NSEC / 1000);
+
+		for (p = mccfg[i] + n; *p != '\0'; p = e + (*e == ',')) {
+			RETERR(a->nout >= MACRO_MAX, 1, EINVAL, "Macro too long %s", mccfg[i]);
+			a->out[a->nout] = strtol(p, &e, 0);
+			RETERR((e == p) || ((*e != ',') && (*e != '\0')), 1, EINVAL, "Could not parse macro parameters %s", mccfg[i]);
+			++(a->nout);
+		}
+		RETERR(a->nout == 0, 1, EINVAL, "Empty macro %s", mccfg[i]);
+	}
+	rfree((void **)mccfg);
+
+	for (i = 0; (afcfg != NULL) && (afcfg[i] != NULL); ++i) {
+		int c[3] = { -1, 0, -1 };
+		struct action *a;
+
+		ret = sscanf(afcfg[i], "%i:%i,%i", &c[0], &c[1], &c[2]);
+		RETERR((ret < 2) || (c[1] <= 0), ret >= 0, EINVAL, "Could not parse autofire parameters %s", afcfg[i]);
+		a = act_new(ACT_AUTOFIRE, c[0], -1);
+		RETERR(a == NULL, 1, EINVAL, "Invalid autofire key %s", afcfg[i]);
+		a->out[0] = (c[2] < 0)?c[0]:c[2];
+		a->nout = 1;
+		a->per = NSEC / c[1];
+	}
+	rfree((void **)afcfg);
+
+	/* Debouncing */
+	for (i = 0; (dbcfg != NULL) && (dbcfg[i] != NULL); ++i) {
+		int c[2] = { -1, 0 };
+
+		ret = sscanf(dbcfg[i], "%i:%i", &c[0], &c[1]);
+		RETERR(ret < 2, ret >= 0, EINVAL, "Could not parse debounce parameters %s", dbcfg[i]);
+		RETERR((c[0] < 0) || (c[0] > KEY_MAX) || (c[1] <= 0) || (c[1] > 1000), 1, EINVAL,
+				"Invalid debounce parameters %s", dbcfg[i]);
+
+		dbw[c[0]] = c[1] * (NSEC / 1000);
+		mclk = 1;
+		dbtmr[c[0]].fn = debounce_tmr;
+		dbtmr[c[0]].arg = c[0];
+	}
+	rfree((void **)dbcfg);
+
+	/* Upsampling */
+	for (i = 0; (upcfg != NULL) && (upcfg[i] != NULL); ++i) {
+		int c[3] = { -1, 0, 50 };
+
+		ret = sscanf(upcfg[i], "%i:%i,%i", &c[0], &c[1], &c[2]);
+		RETERR(ret < 2, ret >= 0, EINVAL, "Could not parse upsampling parameters %s", upcfg[i]);
+		RETERR((c[0] < 0) || (c[0] > ABS_MAX) || (c[1] <= 0) || (c[1] > 4000) ||
+				(c[2] < 0) || (c[2] > 100), 1, EINVAL,
+				"Invalid upsampling parameters %s", upcfg[i]);
+
+		up[c[0]].per = NSEC / c[1];
+		up[c[0]].ovs = c[2];
+		up[c[0]].t.fn = up_tmr;
+		up[c[0]].t.arg = c[0];
+		mclk = 1;
+	}
+	rfree((void **)upcfg);
+
+	/* Output rate limiting */
+	RETERR((rhz < 0) || (rhz > 10000), 1, EINVAL, "Invalid output rate %i", rhz);
+	if (rhz > 0) {
+		rper = NSEC / rhz;
+		rtmr.fn = rate_tmr;
+	}
+
+	/* Motion sensor fusion */
+	memset(&gy, 0, sizeof(gy));
+	gy.acc[0] = gy.acc[1] = -1;
+	RETERR((grcfg != NULL) && (gacfg != NULL), 1, EINVAL, "Only one of --gyro-rel and --gyro-abs may be used");
+	if ((grcfg != NULL) || (gacfg != NULL)) {
+		char *g = (grcfg != NULL)?grcfg:gacfg;
+
+		gy.mode = (grcfg != NULL)?GY_REL:GY_ABS;
+		gy.sens = (gy.mode == GY_REL)?10:45;
+		ret = sscanf(g, "%i,%i:%i,%i,%i", &gy.in[0], &gy.in[1], &gy.out[0], &gy.out[1], &gy.sens);
+		RETERR(ret < 4, ret >= 0, EINVAL, "Could not parse gyro parameters %s", g);
+		RETERR((gy.in[0] < 0) || (gy.in[0] > ABS_MAX) || (gy.in[1] < 0) || (gy.in[1] > ABS_MAX) ||
+				(gy.out[0] < 0) || (gy.out[1] < 0) || (gy.sens <= 0) ||
+				(gy.out[0] > ((gy.mode == GY_REL)?REL_MAX:ABS_MAX)) ||
+				(gy.out[1] > ((gy.mode == GY_REL)?REL_MAX:ABS_MAX)) ||
+				((gy.mode == GY_REL) && (gy.sens > 10000)) ||
+				((gy.mode == GY_ABS) && (gy.sens > 180)), 1, EINVAL,
+				"Invalid gyro parameters %s", g);
+		free(g);
+	}
+	if (gxcfg != NULL) {
+		gy.aw = 5;
+		ret = sscanf(gxcfg, "%i,%i,%i", &gy.acc[0], &gy.acc[1], &gy.aw);
+		RETERR(ret < 2, ret >= 0, EINVAL, "Could not parse gyro-accel parameters");
+		RETERR((gy.acc[0] < 0) || (gy.acc[0] > ABS_MAX) || (gy.acc[1] < 0) || (gy.acc[1] > ABS_MAX) ||
+				(gy.aw < -1000) || (gy.aw > 1000), 1, EINVAL, "Invalid gyro-accel parameters");
+		free(gxcfg);
+	}
+	if (gccfg != NULL) {
+		ret = sscanf(gccfg, "%i,%i", &gthr, &gstill);
+		RETERR(ret < 1, ret >= 0, EINVAL, "Could not parse gyro-cal parameters");
+		RETERR((gthr < 0) || (gstill < 0), 1, EINVAL, "Invalid gyro-cal parameters");
+		free(gccfg);
+	}
+
+	for (i = 0; i <= GATAN; ++i)
+		atab[i] = lround(atan((double)i / GATAN) * 180000.0 / M_PI);
 
 
 	/* Open the syslog facility */
-	if (log == 1) {
+	if (syslg == 1) {
 		openlog("evmapd", LOG_PID, LOG_DAEMON);
-		log = 2;
+		syslg = 2;
 	}
 	if (quiet && !detach) {
 		fclose(stdin);
@@ -487,11 +3053,24 @@ int main(int argc, char **argv)
 	}
 
 	/* Open the input device */
-	ifp = open(idev, O_RDONLY);
+	ifp = open(idev, O_RDWR);
+	if (ifp >= 0)
+		iwr = 1;
+	else
+		ifp = open(idev, O_RDONLY);
 	RETERN(ifp < 0, "Unable to open input device %s", idev);
 
+	/* Debouncing and upsampling compare the input timestamps with the timer clock */
+	if (mclk) {
+		int clk = CLOCK_MONOTONIC;
+
+		iclk = (ioctl(ifp, EVIOCSCLOCKID, &clk) == 0);
+		if (!iclk)
+			msg("Warning: could not set the clock of %s, using the arrival time\n", idev);
+	}
+
 	/* Open the output device */
-	ofp = open(odev, O_WRONLY);
+	ofp = open(odev, O_RDWR | O_NONBLOCK);
 	RETERN(ofp < 0, "Unable to open output device %s", odev);
 	
 	/* Grab the input device */
@@ -502,6 +3081,7 @@ int main(int argc, char **argv)
 
 
 	/* Get the input device information */
+	memset(ares, 0, sizeof(ares));
 	memset(ibits, 0, sizeof(ibits));
 	memset(rbits, 0, sizeof(rbits));
 	memset(obits, 0, sizeof(obits));
@@ -522,12 +3102,21 @@ int main(int argc, char **argv)
 						struct input_absinfo abs;
 
 						INQ(EVIOCGABS(j), &abs);
+						ares[j] = abs.resolution;
 						uidev.absmax[j] = abs.maximum;
 						uidev.absmin[j] = abs.minimum;
 						uidev.absfuzz[j] = abs.fuzz;
 						uidev.absflat[j] = abs.flat;
 					}
 				}
+
+				/* Cache the input range for the normalisation code */
+				for (j = 0; j <= ABS_MAX; ++j) {
+					ac[j].imin = uidev.absmin[j];
+					ac[j].irng = uidev.absmax[j] - uidev.absmin[j];
+					if (ac[j].nspkmin >= ac[j].irng)
+						ac[j].nspk = 0;
+				}
 			}
 		}
 	}
@@ -563,12 +3152,18 @@ int main(int argc, char **argv)
 			info("\n");
 		}
 
-		if (nm != NULL) {
-			info("\t\tNormalised ABS axis:");
-			for (i = 0; nm[i] != NULL; ++i)
-				info(" %i", *(nm[i]));
-			info("\n\n");
-		}
+		for (i = 0, j = 0; i <= ABS_MAX; ++i)
+			if (ac[i].norm) {
+				if (j++ == 0)
+					info("\tNormalised ABS axis:\n");
+				info("\t\t%2d)  Ignore:%6d   Range:%6d   Reset:%6d   Spike:%6d/%d", i,
+					ac[i].ign, ac[i].nrng, ac[i].nrst, ac[i].nspk, ac[i].nspkmin);
+				if (ac[i].norm == NRM_QUANT)
+					info("   Quantiles:%4d/%d", aq[i].plo, aq[i].phi);
+				info("\n");
+			}
+		if (j > 0)
+			info("\n");
 
 		listbits(ibits, EV_MSC, MSC_MAX, "MSC");
 		listbits(ibits, EV_SW, SW_MAX, "SW");
@@ -663,7 +3258,7 @@ int main(int argc, char **argv)
 		SET(obits[EV_EV], EV_REL, 1);
 		for (i = 0; ARM(i, 0) != -1; ++i)
 			if GET(ibits[EV_ABS], ARM(i, 0)) {
-				SET(rbits[EV_ABS], AKM(i, 0), 1);
+				SET(rbits[EV_ABS], ARM(i, 0), 1);
 				SET(obits[EV_REL], ARM(i, 1), 1);
 			}
 	}
@@ -683,6 +3278,146 @@ int main(int argc, char **argv)
 			}
 	}
 
+	if (llm != NULL) {
+		SET(obits[EV_EV], EV_LED, 1);
+		for (i = 0; LLM(i, 0) != -1; ++i)
+			if GET(ibits[EV_LED], LLM(i, 0)) {
+				SET(rbits[EV_LED], LLM(i, 0), 1);
+				SET(obits[EV_LED], LLM(i, 1), 1);
+			}
+	}
+	if (ssm != NULL) {
+		SET(obits[EV_EV], EV_SND, 1);
+		for (i = 0; SSM(i, 0) != -1; ++i)
+			if GET(ibits[EV_SND], SSM(i, 0)) {
+				SET(rbits[EV_SND], SSM(i, 0), 1);
+				SET(obits[EV_SND], SSM(i, 1), 1);
+			}
+	}
+
+	if (mton) {
+		RETERR(!GET(ibits[EV_ABS], ABS_MT_SLOT), 1, EINVAL, "Input device %s has no multitouch slots", idev);
+
+		mtmin[0] = uidev.absmin[ABS_MT_POSITION_X];
+		mtrng[0] = uidev.absmax[ABS_MT_POSITION_X] - mtmin[0];
+		mtmin[1] = uidev.absmin[ABS_MT_POSITION_Y];
+		mtrng[1] = uidev.absmax[ABS_MT_POSITION_Y] - mtmin[1];
+
+		lgmin[0] = uidev.absmin[ABS_X];
+		lgrng[0] = uidev.absmax[ABS_X] - lgmin[0];
+		lgmin[1] = uidev.absmin[ABS_Y];
+		lgrng[1] = uidev.absmax[ABS_Y] - lgmin[1];
+
+		if (mtxf[0]) {
+			uodev.absmin[ABS_MT_POSITION_X] = uidev.absmin[ABS_MT_POSITION_Y];
+			uodev.absmax[ABS_MT_POSITION_X] = uidev.absmax[ABS_MT_POSITION_Y];
+			uodev.absmin[ABS_MT_POSITION_Y] = uidev.absmin[ABS_MT_POSITION_X];
+			uodev.absmax[ABS_MT_POSITION_Y] = uidev.absmax[ABS_MT_POSITION_X];
+
+			/* The single-touch emulation follows the slots */
+			if (!mtcnv) {
+				uodev.absmin[ABS_X] = uidev.absmin[ABS_Y];
+				uodev.absmax[ABS_X] = uidev.absmax[ABS_Y];
+				uodev.absmin[ABS_Y] = uidev.absmin[ABS_X];
+				uodev.absmax[ABS_Y] = uidev.absmax[ABS_X];
+			}
+		}
+
+		/* The converted output replaces the multitouch and single-touch events */
+		if (mtcnv) {
+			for (i = 0; i <= ABS_MAX; ++i)
+				if (ISMT(i) || ISMTLEG(i))
+					SET(rbits[EV_ABS], i, 1);
+			for (i = 0; i < KEY_MAX; ++i)
+				if (ISMTTOOL(i))
+					SET(rbits[EV_KEY], i, 1);
+		}
+
+		if (mtabs[0] >= 0) {
+			SET(obits[EV_EV], EV_ABS, 1);
+			SET(obits[EV_EV], EV_KEY, 1);
+			SET(obits[EV_ABS], mtabs[0], 1);
+			SET(obits[EV_ABS], mtabs[1], 1);
+			SET(obits[EV_KEY], BTN_TOUCH, 1);
+			for (i = 0; i < 2; ++i) {
+				uodev.absmin[mtabs[i]] = uodev.absmin[ABS_MT_POSITION_X + i];
+				uodev.absmax[mtabs[i]] = uodev.absmax[ABS_MT_POSITION_X + i];
+				uodev.absfuzz[mtabs[i]] = 0;
+				uodev.absflat[mtabs[i]] = 0;
+			}
+		}
+		if (mtrel[0] >= 0) {
+			SET(obits[EV_EV], EV_REL, 1);
+			SET(obits[EV_REL], mtrel[0], 1);
+			SET(obits[EV_REL], mtrel[1], 1);
+		}
+		if (mtscr[0] >= 0) {
+			SET(obits[EV_EV], EV_REL, 1);
+			SET(obits[EV_REL], mtscr[0], 1);
+			SET(obits[EV_REL], mtscr[1], 1);
+		}
+	}
+
+	for (i = 0; i < npair; ++i) {
+		ap[i].rx = (uodev.absmax[ap[i].x] - uodev.absmin[ap[i].x]) / 2;
+		ap[i].ry = (uodev.absmax[ap[i].y] - uodev.absmin[ap[i].y]) / 2;
+		ap[i].cx = ap[i].vx = uodev.absmin[ap[i].x] + ap[i].rx;
+		ap[i].cy = ap[i].vy = uodev.absmin[ap[i].y] + ap[i].ry;
+	}
+
+	if (gy.mode) {
+		RETERR(!GET(ibits[EV_ABS], gy.in[0]) || !GET(ibits[EV_ABS], gy.in[1]), 1, EINVAL,
+				"Input device %s has no such gyro axis", idev);
+
+		gy.res = ares[gy.in[0]];
+		if (gy.res <= 0) {
+			msg("Warning: no gyro resolution for %s, assuming 1 unit per degree/s\n", idev);
+			gy.res = 1;
+		}
+		gy.thr = gthr * gy.res;
+		gy.still = gstill * 1000;
+
+		for (i = 0; i < 2; ++i) {
+			SET(rbits[EV_ABS], gy.in[i], 1);
+			if (gy.acc[i] >= 0)
+				SET(rbits[EV_ABS], gy.acc[i], 1);
+		}
+		if (gy.mode == GY_REL) {
+			SET(obits[EV_EV], EV_REL, 1);
+			for (i = 0; i < 2; ++i)
+				SET(obits[EV_REL], gy.out[i], 1);
+		} else {
+			SET(obits[EV_EV], EV_ABS, 1);
+			for (i = 0; i < 2; ++i) {
+				SET(obits[EV_ABS], gy.out[i], 1);
+				uodev.absmin[gy.out[i]] = amin;
+				uodev.absmax[gy.out[i]] = amax;
+				uodev.absfuzz[gy.out[i]] = 0;
+				uodev.absflat[gy.out[i]] = 0;
+				gy.omin[i] = amin;
+				gy.orng[i] = (amax > amin)?(amax - amin):1;
+				gy.out0[i] = amin - 1;
+			}
+		}
+	}
+
+	for (i = 0; i <= ABS_MAX; ++i) {
+		up[i].min = uodev.absmin[i];
+		up[i].max = uodev.absmax[i];
+	}
+
+	for (i = 0; i < nact; ++i) {
+		SET(obits[EV_EV], EV_KEY, 1);
+		for (j = 0; j < 2; ++j)
+			if ((act[i].key[j] >= 0) && GET(ibits[EV_KEY], act[i].key[j])) {
+				SET(rbits[EV_KEY], act[i].key[j], 1);
+				if (act[i].type == ACT_CHORD)
+					SET(obits[EV_KEY], act[i].key[j], 1);
+			}
+		for (j = 0; j < act[i].nout; ++j)
+			SET(obits[EV_KEY], act[i].out[j], 1);
+	}
+
 	/* Do not let through the remapped event bits */	
 	for (i = 0; i < EV_MAX; ++i)
 		for (j = 0; j < LEN(long, KEY_MAX); ++j)
@@ -729,9 +3464,45 @@ int main(int argc, char **argv)
 	}
 
 
-	/* Clear force feedback capability until it is properly implemented. */
-	/* See <linux/uinput.h> ("To write a force-feedback-capable driver ...") */
-	SET(obits[0], EV_FF, 0);
+	/* Remap kernel */
+	if (cfile != NULL) {
+		ret = kbuild(cfile, &uidev, &uodev, rmin, rmax);
+		free(cfile);
+		return ret;
+	}
+	if (kfile != NULL) {
+		kload(kfile, &uidev, &uodev, rmin, rmax);
+		free(kfile);
+	}
+
+	/* In-kernel key remapping */
+	if (keymap) {
+		ret = kmap_offload();
+		if (ret != 0)
+			return ret;
+	}
+
+	/* Force feedback is forwarded to the input device, if it can be written to */
+	if (iwr && GET(obits[0], EV_FF)) {
+		INQ(EVIOCGEFFECTS, &i);
+		uodev.ff_effects_max = (i > FF_MAX_EFFECTS)?FF_MAX_EFFECTS:i;
+		ffon = 1;
+
+		/* The kernel echoes the forwarded effects back to every reader */
+		memset(rbits[EV_FF], 0xff, sizeof(rbits[EV_FF]));
+	}
+	if (uodev.ff_effects_max == 0) {
+		ffon = 0;
+		SET(obits[0], EV_FF, 0);
+		memset(obits[EV_FF], 0, sizeof(obits[EV_FF]));
+	}
+	for (i = 0; i < FF_MAX_EFFECTS; ++i)
+		ffmap[i] = -1;
+
+	/* Sounds are echoed back like effects. LEDs are not, the kernel only
+	 * passes on changes of their state. */
+	if (iwr)
+		memset(rbits[EV_SND], 0xff, sizeof(rbits[EV_SND]));
 
 	/* Prepare the output device */
 	OSET(UI_SET_PHYS, ophys);
@@ -742,7 +3513,7 @@ int main(int argc, char **argv)
 	OSETBIT(EV_MSC, UI_SET_MSCBIT, MSC_MAX);
 	OSETBIT(EV_LED, UI_SET_LEDBIT, LED_MAX);
 	OSETBIT(EV_SND, UI_SET_SNDBIT, SND_MAX);
-/*	OSETBIT(EV_FF,  UI_SET_FFBIT,  FF_MAX); */
+	OSETBIT(EV_FF,  UI_SET_FFBIT,  FF_MAX);
 	OSETBIT(EV_SW,  UI_SET_SWBIT,  SW_MAX);
 
 	ret = write(ofp, &uodev, sizeof(uodev));
@@ -750,6 +3521,31 @@ int main(int argc, char **argv)
 	OSET(UI_DEV_CREATE, NULL);
 
 
+	/* Shared memory state export */
+	if (stfile != NULL) {
+		int sfp;
+
+		sfp = open(stfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		RETERN(sfp < 0, "Unable to create state file %s", stfile);
+		ret = ftruncate(sfp, sizeof(*st));
+		RETERN(ret < 0, "Unable to create state file %s", stfile);
+		st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED, sfp, 0);
+		close(sfp);
+		if (st == MAP_FAILED)
+			st = NULL;
+		RETERN(st == NULL, "Unable to map state file %s", stfile);
+
+		memset(&sts, 0, sizeof(sts));
+		sts.magic = EVMAPD_STATE_MAGIC;
+		sts.version = EVMAPD_STATE_VERSION;
+		for (i = 0; i < EVMAPD_STATE_ABS; ++i) {
+			sts.absmin[i] = uodev.absmin[i];
+			sts.absmax[i] = uodev.absmax[i];
+		}
+		memcpy(st, &sts, sizeof(sts));
+		st_publish();
+	}
+
 	/* Daemon mode */
 	if (detach) {
 		ret = daemon(0, 0);
@@ -766,40 +3562,155 @@ int main(int argc, char **argv)
 
 	/* Setup the signal handlers */
 	signal(SIGTERM, on_term);
+	signal(SIGINT, on_term);
+	signal(SIGHUP, on_term);
+	signal(SIGUSR1, on_usr1);
 
+	/* Setup the timers */
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	RETERN(tfd < 0, "Unable to create timer");
+	wtick = now_ns() / TICK;
 
-#define _RCV			ret = read(ifp, &ev, sizeof(ev)); \
-				RETERR(ret < (int)(sizeof(ev)), ret >= 0, EIO, "Unable to receive event from %s", idev);
 
-#define _SND			ret = write(ofp, &ev, sizeof(ev)); \
-				RETERR(ret < (int)(sizeof(ev)), ret >= 0, EIO, "Unable to send event to %s", odev); \
-				if (ev.type == EV_KEY) SET(rbits[EV_KEY], ev.code, ev.value);
+#define RCV			ret = read(ifp, ib, sizeof(ib)); \
+				RETERR(ret < (int)(sizeof(ev)), ret >= 0, EIO, "Unable to receive event from %s", idev); \
+				ibn = ret / sizeof(ev); \
+				ibr = 0; \
+				ibm = ptcls(ib, ibn); \
+				ptev += ibn;
+
+#define SND			do { \
+					ret = snd(&ev); \
+					if (ret != 0) \
+						return ret; \
+				} while (0)
 
-#if DEBUG
-#define RCV			_RCV \
-				if (verbose) \
-					info("IN: %6i %6i %6i\n", ev.type, ev.code, ev.value);
-#define SND			if (verbose) \
-					info("OUT: %6i %6i %6i\n", ev.type, ev.code, ev.value); \
-				_SND
-#else
-#define RCV			_RCV
-#define SND			_SND
-#endif
 
 
 	/* The event loop */
-	memset(rbits, 0, sizeof(rbits));
+	memset(kst, 0, sizeof(kst));
+
+	struct input_event ib[IBATCH];
+	unsigned long long ibm = 0;
+	int ibn = 0, ibr = 0;
+
+	pt_build(rbits);
+	ptcls = pt_classify;
+#if PT_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		ptcls = pt_classify_avx2;
+#endif
+
+	struct pollfd pfd[3] = { { ifp, POLLIN, 0 }, { tfd, POLLIN, 0 }, { ofp, POLLIN, 0 } };
+
 	while (1) {
-		int irng;
+		int irng, inj = (injr != injw);
+
+		if (inj) {
+			ev = injq[injr];
+			injr = (injr + 1) % INJQ;
+		} else if (ibr == ibn) {
+			ret = poll(pfd, 2 + iwr, -1);
+			RETERN((ret < 0) && (errno != EINTR), "Unable to wait for events");
+
+			if (dump) {
+				dump = 0;
+				stats();
+			}
+			if (ret < 0)
+				continue;
+
+			/* Timers first, so that they never wait behind input */
+			if (pfd[1].revents & POLLIN) {
+				ret = tmr_run();
+				if (ret != 0)
+					return ret;
+			}
+
+			if (iwr && (pfd[2].revents & POLLIN)) {
+				ret = fb_run();
+				if (ret != 0)
+					return ret;
+			}
+
+			if ((pfd[0].revents == 0) || (injr != injw))
+				continue;
+
+			RCV;
+		}
+
+		/* Runs of events that need no processing go out in one write */
+		if (!inj) {
+			i = (ibm >> ibr)?(ibr + __builtin_ctzll(ibm >> ibr)):ibn;
+			if (i > ibr) {
+				ret = pt_snd(&ib[ibr], i - ibr);
+				if (ret != 0)
+					return ret;
+				ibr = i;
+			}
+			if (ibr == ibn)
+				continue;
+
+			ev = ib[ibr++];
+#if DEBUG
+			if (verbose)
+				info("IN: %6i %6i %6i\n", ev.type, ev.code, ev.value);
+#endif
+		}
 
-		RCV;
+		/* Specialised remap kernel */
+		if ((kern != NULL) && (kern(&ev) > 0)) {
+			SND;
+			continue;
+		}
 
 		/* Event processing */
 		j = 1;
 		ret = 1;
 		switch (ev.type) {
+			case EV_SYN:
+				if (ev.code != SYN_REPORT)
+					break;
+				if (mton) {
+					ret = mt_syn();
+					if (ret != 0)
+						return ret;
+				}
+				if (gy.mode) {
+					ret = gyro_syn(&ev);
+					if (ret != 0)
+						return ret;
+				}
+				if (npair > 0) {
+					ret = pair_syn();
+					if (ret != 0)
+						return ret;
+				}
+				break;
+			case EV_MSC:
+				if (gy.mode && (ev.code == MSC_TIMESTAMP)) {
+					gy.ts = ev.value;
+					if (!gy.hts)
+						gy.pts = gy.ts;
+					gy.hts = 1;
+				}
+				break;
 			case EV_KEY:
+				if ((dbw[ev.code] > 0) && !inj && !debounce(&ev)) {
+					j = 0;
+					break;
+				}
+				if (mtcnv && ISMTTOOL(ev.code)) {
+					j = 0;
+					break;
+				}
+				if (actk[ev.code] >= 0) {
+					ret = act_key(&act[(int)actk[ev.code]], ev.code, ev.value);
+					if (ret != 0)
+						return ret;
+					j = 0;
+					break;
+				}
 				if (ret && (kkm != NULL))
 					for (i = 0; KKM(i, 0) != -1; ++i)
 						if (KKM(i, 0) == ev.code) {
@@ -840,7 +3751,7 @@ int main(int argc, char **argv)
 						if (RKM(i, 0) == ev.code) {
 							ev.type = EV_KEY;
 							if (ev.value < 0) {
-								if GET(rbits[EV_KEY], RKM(i, 2)) {
+								if GET(kst, RKM(i, 2)) {
 									ev.code = RKM(i, 2);
 									ev.value = 0;
 									SND;
@@ -848,7 +3759,7 @@ int main(int argc, char **argv)
 								ev.code = RKM(i, 1);
 								ev.value = 1;
 							} else if (ev.value > 0) {
-								if GET(rbits[EV_KEY], RKM(i, 1)) {
+								if GET(kst, RKM(i, 1)) {
 									ev.code = RKM(i, 1);
 									ev.value = 0;
 									SND;
@@ -858,11 +3769,11 @@ int main(int argc, char **argv)
 							} else {
 								j = 0;
 								ev.value = 0;
-								if GET(rbits[EV_KEY], RKM(i, 1)) {
+								if GET(kst, RKM(i, 1)) {
 									ev.code = RKM(i, 1);
 									SND;
 								}
-								if GET(rbits[EV_KEY], RKM(i, 2)) {
+								if GET(kst, RKM(i, 2)) {
 									ev.code = RKM(i, 2);
 									SND;
 								}
@@ -874,6 +3785,10 @@ int main(int argc, char **argv)
 					for (i = 0; RRM(i, 0) != -1; ++i)
 						if (RRM(i, 0) == ev.code) {
 							ev.code = RRM(i, 1);
+							if (rcv[RRM(i, 0)] != NULL) {
+								ev.value = curve_rel(rcv[RRM(i, 0)], &racc[ev.code], ev.value);
+								j = (ev.value != 0);
+							}
 							ret = 0;
 							break;
 						}
@@ -892,103 +3807,63 @@ int main(int argc, char **argv)
 							break;
 						}
 				break;
+			case EV_FF:
+				/* Echo of an effect forwarded by fb_run() */
+				if (ffon)
+					j = 0;
+				break;
+			case EV_LED:
+				for (i = 0; (llm != NULL) && (LLM(i, 0) != -1); ++i)
+					if (LLM(i, 0) == ev.code) {
+						ev.code = LLM(i, 1);
+						break;
+					}
+				break;
+			case EV_SND:
+				/* Echo of a sound forwarded by fb_run() */
+				if (iwr) {
+					j = 0;
+					break;
+				}
+				for (i = 0; (ssm != NULL) && (SSM(i, 0) != -1); ++i)
+					if (SSM(i, 0) == ev.code) {
+						ev.code = SSM(i, 1);
+						break;
+					}
+				break;
 			case EV_ABS:
-				irng = uidev.absmax[ev.code] - uidev.absmin[ev.code];
-
-				if (nm != NULL) {
-					/* Auto-calibration */
-					for (i = 0; nm[i] != NULL; ++i)
-						if (*(nm[i]) == ev.code) {
-							if (AC[RDY]) {
-								/* Spike protection */
-								if ((nspk > 0) && (nspkmin < irng)) {
-									if (labs((long)ev.value - (long)AC[LAST]) * (long)(nspk) > (long)irng)
-										break;
-									AC[LAST] = ev.value;
-								}
-								
-								/* Auto-calibration reset code */
-								if (nrst > 0) {
-									if (AC[ACNT] > 0) {
-										++AC[ACNT];
-
-										if (ev.value < AC[AMIN])
-											AC[AMIN] = ev.value;	
-										if (ev.value > AC[AMAX])
-											AC[AMAX] = ev.value;
-								
-										if (AC[ACNT] >= nrst) {
-											if ((nrng == 0) || ((long)(AC[AMAX] - AC[AMIN]) * (long)nrng >= irng)) {
-												AC[RMIN] = AC[AMIN];
-												AC[RMAX] = AC[AMAX];
-												AC[AMIN] = 0;
-												AC[AMAX] = 0;
-												AC[ACNT] = 0;
-											} else {
-												AC[ACNT] = nrst - 1;
-											}
-										}
-									} else {
-										if (AC[AMIN] == 0) {
-											AC[AMIN] = ev.value;
-										} else {
-											if (AC[AMIN] < ev.value) {
-												AC[AMAX] = ev.value;
-												++AC[ACNT];
-											} else if (AC[AMIN] > ev.value) {
-												AC[AMAX] = AC[AMIN];
-												AC[AMIN] = ev.value;
-												++AC[ACNT];
-											}
-										}
-									}
-								}
-								
-								if (ev.value < AC[RMIN])
-									AC[RMIN] = ev.value;	
-								if (ev.value > AC[RMAX])
-									AC[RMAX] = ev.value;
-									
-								/* The actual auto-calibration formula */
-								if ((nrng == 0) || ((long)(AC[RMAX] - AC[RMIN]) * (long)nrng >= irng))
-									ev.value = (irng * (ev.value - AC[RMIN])) / (AC[RMAX] - AC[RMIN]) +
-											uidev.absmin[ev.code];
-							} else {
-								/* Ignore initial events */
-								if (AC[IGN] > 0) {
-									--AC[IGN];
-									break;
-								}
-								
-								if (AC[RMIN] == 0) {
-									AC[RMIN] = ev.value;
-								} else {
-									/* Spike protection */
-									if ((nspk > 0) && (nspkmin < irng)) {
-										if (labs((long)ev.value - (long)AC[RMIN]) * (long)(nspk) > (long)irng)
-											break;
-										AC[LAST] = ev.value;
-									}
-									
-									if (AC[RMIN] < ev.value) {
-										AC[RMAX] = ev.value;
-										AC[RDY] = 1;
-									} else if (AC[RMIN] > ev.value) {
-										AC[RMAX] = AC[RMIN];
-										AC[RMIN] = ev.value;
-										AC[RDY] = 1;
-									}
-								}
-							}
-						}
+				/* Motion sensor axis are fused at the end of the frame */
+				if (gy.mode && gyro_abs(&ev)) {
+					j = 0;
+					break;
+				}
+
+				/* Multitouch events never reach the per-axis code */
+				if (mton && ISMT(ev.code)) {
+					j = mt_abs(&ev);
+					break;
 				}
+				if (mtcnv && ISMTLEG(ev.code)) {
+					j = 0;
+					break;
+				}
+				if (mton && ((ev.code == ABS_X) || (ev.code == ABS_Y)))
+					mt_xform(&ev, ev.code == ABS_X, lgmin, lgrng, ABS_X, ABS_Y);
+
+				irng = AC.irng;
+
+				/* Auto-calibration */
+				if (AC.norm == NRM_RANGE)
+					ev.value = normalise(&AC, ev.value);
+				else if (AC.norm == NRM_QUANT)
+					ev.value = normalise_q(&AC, &aq[ev.code], ev.value);
 
 				if (ret && (akm != NULL))
 					for (i = 0; AKM(i, 0) != -1; ++i)
 						if (AKM(i, 0) == ev.code) {
 							ev.type = EV_KEY;
 							if (ev.value <= (uidev.absmin[ev.code] + (irng / 4))) {
-								if GET(rbits[EV_KEY], AKM(i, 2)) {
+								if GET(kst, AKM(i, 2)) {
 									ev.code = AKM(i, 2);
 									ev.value = 0;
 									SND;
@@ -996,7 +3871,7 @@ int main(int argc, char **argv)
 								ev.code = AKM(i, 1);
 								ev.value = 1;
 							} else if (ev.value >= (uidev.absmax[ev.code] - (irng / 4))) {
-								if GET(rbits[EV_KEY], AKM(i, 1)) {
+								if GET(kst, AKM(i, 1)) {
 									ev.code = AKM(i, 1);
 									ev.value = 0;
 									SND;
@@ -1005,11 +3880,11 @@ int main(int argc, char **argv)
 								ev.value = 1;
 							} else {
 								ev.value = 0;
-								if GET(rbits[EV_KEY], AKM(i, 1)) {
+								if GET(kst, AKM(i, 1)) {
 									ev.code = AKM(i, 1);
 									SND;
 								}
-								if GET(rbits[EV_KEY], AKM(i, 2)) {
+								if GET(kst, AKM(i, 2)) {
 									ev.code = AKM(i, 2);
 									SND;
 								}
@@ -1022,7 +3897,13 @@ int main(int argc, char **argv)
 					for (i = 0; ARM(i, 0) != -1; ++i)
 						if (ARM(i, 0) == ev.code) {
 							ev.type = EV_REL;
-							ev.value = rmin + ((ev.value - uidev.absmin[ev.code]) * (rmax - rmin)) / irng;
+							if (acv[ev.code] != NULL) {
+								ev.value = curve_abs(acv[ev.code], &racc[ARM(i, 1)], ev.value,
+										uidev.absmin[ev.code], irng, rmin, rmax);
+								j = (ev.value != 0);
+							} else {
+								ev.value = rmin + ((ev.value - uidev.absmin[ev.code]) * (rmax - rmin)) / irng;
+							}
 							ev.code = ARM(i, 1);
 							ret = 0;
 							break;
@@ -1039,6 +3920,18 @@ int main(int argc, char **argv)
 				break;
 		}
 
+		/* Hold paired axis until the end of the frame */
+		if (j && (ev.type == EV_ABS) && (apx[ev.code] >= 0)) {
+			struct axpair *a = &ap[(int)apx[ev.code]];
+
+			if (ev.code == a->x)
+				a->vx = ev.value;
+			else
+				a->vy = ev.value;
+			a->dirty = 1;
+			j = 0;
+		}
+
 		if (j)
 			SND;
 	}